@@ -0,0 +1,55 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+//
+// Exception throwing:  each throw unwinds through stamped frames, so the unwinder has to
+// evaluate the stamped return address rules (see stamp_rule in ss.cpp).
+//
+#include <iostream>
+#include <stdexcept>
+#include <stdlib.h>
+
+using namespace std;
+
+__attribute__((noinline)) static unsigned thrower(unsigned depth, unsigned x)
+{
+	if(depth==0)
+	{
+		if(x%4==0)
+			throw runtime_error("boom");
+		return x;
+	}
+	return thrower(depth-1, x+1)+1;
+}
+
+int main(int argc, char* argv[])
+{
+	const auto iters = argc>1 ? strtoul(argv[1], NULL, 0) : 1000000ul;
+	auto caught=0ul, acc=0ul;
+	for(auto i=0ul; i<iters; i++)
+	{
+		try
+		{
+			acc+=thrower(8, i);
+		}
+		catch(const runtime_error&)
+		{
+			caught++;
+		}
+	}
+	cout << "except=" << acc << " caught=" << caught << endl;
+	return 0;
+}
@@ -0,0 +1,33 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+//
+// Deep recursion:  every call is a stamped entry and a stamped return.
+//
+#include <stdio.h>
+#include <stdlib.h>
+
+__attribute__((noinline)) static unsigned long fib(unsigned n)
+{
+	return n<2 ? n : fib(n-1)+fib(n-2);
+}
+
+int main(int argc, char* argv[])
+{
+	const unsigned n = argc>1 ? atoi(argv[1]) : 38;
+	printf("fib(%u)=%lu\n", n, fib(n));
+	return 0;
+}
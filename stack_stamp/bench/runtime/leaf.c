@@ -0,0 +1,38 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+//
+// Tiny leaf functions called from a hot loop:  the stamps are a large fraction of each call.
+//
+// The stamper skips functions of 3 instructions or fewer (see StackStamp_t::can_stamp), so each leaf 
+// must compile to more than that (at -O2, step is 4 instructions and clamp is 9), or it would measure nothing.
+//
+#include <stdio.h>
+#include <stdlib.h>
+
+__attribute__((noinline)) static unsigned step(unsigned x)  { return (x+1) ^ (x >> 13); }
+__attribute__((noinline)) static unsigned mix(unsigned x)   { return (x ^ (x >> 7)) * 0x9e3779b1u; }
+__attribute__((noinline)) static unsigned clamp(unsigned x) { return x > 1000000u ? x % 1000000u : x; }
+
+int main(int argc, char* argv[])
+{
+	const unsigned long iters = argc>1 ? strtoul(argv[1], NULL, 0) : 100000000ul;
+	unsigned acc=1;
+	for(unsigned long i=0; i<iters; i++)
+		acc=clamp(mix(step(acc)));
+	printf("leaf=%u\n", acc);
+	return 0;
+}
@@ -0,0 +1,154 @@
+#!/bin/bash
+#
+#   Copyright 2017-2019 University of Virginia
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+
+#
+# Measure the run-time cost of stack stamping.
+#
+# Each benchmark program in this directory is built, stamped with the stack_stamp step, and
+# then the original and stamped programs are run alternately, pinned to one CPU.  The median
+# times give the slowdown.  If perf works on this machine, each program is also run once under
+# perf stat for cycles, branch mispredicts and (where the CPU has such an event) return
+# mispredicts.
+#
+# The stamper skips functions of 3 instructions or fewer, so a benchmark's hot functions must be 
+# bigger than that to be measured at all (see leaf.c).
+#
+# usage: overhead.sh [-r reps] [-c cpu] [-o dir] [-s "stack_stamp options"] [program ...]
+#
+#    -r reps    how many timed runs of each version (default 5)
+#    -c cpu     which CPU to pin to (default 2)
+#    -o dir     where to build (default a new temporary directory, kept afterwards)
+#    -s opts    options for the stack_stamp step (default "--quiet")
+#    program    a subset of the benchmarks, by name (default all of them)
+#
+# Environment:
+#    PSZ        how to run the rewriter (required, as set up by the zipr image)
+#    CC, CXX    compilers (default cc and c++)
+#    CFLAGS     compiler flags (default -O2)
+#    RET_MISS   the perf event for return mispredicts (default: br_misp_retired.near_ret if perf lists it)
+#
+
+reps=5
+cpu=2
+dir=""
+ss_opts="--quiet"
+while getopts "r:c:o:s:h" opt; do
+	case $opt in
+		r) reps=$OPTARG ;;
+		c) cpu=$OPTARG ;;
+		o) dir=$OPTARG ;;
+		s) ss_opts=$OPTARG ;;
+		*) sed -n '/^# usage:/,/^# Environment/p' "$0" | sed 's/^# \{0,1\}//' | head -n -1 ; exit 1 ;;
+	esac
+done
+shift $((OPTIND-1))
+
+if [[ -z "$PSZ" ]]; then
+	echo "PSZ is not set, run this from the zipr image."
+	exit 1
+fi
+
+src=$(cd "$(dirname "$0")" && pwd)
+dir=${dir:-$(mktemp -d -t ss_overhead.XXXXXX)}
+mkdir -p "$dir"
+CC=${CC:-cc}
+CXX=${CXX:-c++}
+CFLAGS=${CFLAGS:-"-O2"}
+
+# the benchmarks, by name
+programs=("$@")
+if [[ ${#programs[@]} -eq 0 ]]; then
+	programs=($(cd "$src" && ls *.c *.cpp | sed 's/\.[^.]*$//'))
+fi
+
+# pin if we can
+pin=""
+if command -v taskset > /dev/null && taskset -c "$cpu" true 2> /dev/null; then
+	pin="taskset -c $cpu"
+else
+	echo "# cannot pin to CPU $cpu, timing unpinned"
+fi
+
+# perf, if it works here
+perf_events=""
+if command -v perf > /dev/null && perf stat -e cycles true > /dev/null 2>&1; then
+	perf_events="cycles,instructions,branch-misses"
+	ret_miss=${RET_MISS:-$(perf list 2>/dev/null | grep -o "br_misp_retired.near_ret" | head -1)}
+	[[ -n "$ret_miss" ]] && perf_events="$perf_events,$ret_miss"
+fi
+
+# run a command once, print the elapsed seconds.
+time_one() {
+	local start end
+	start=$(date +%s%N)
+	$pin "$@" > /dev/null
+	end=$(date +%s%N)
+	awk -v s="$start" -v e="$end" 'BEGIN { printf "%.6f\n", (e-s)/1e9 }'
+}
+
+# the median of the arguments
+median() {
+	printf "%s\n" "$@" | sort -g | awk '{ v[NR]=$1 } END { if(NR%2) print v[(NR+1)/2]; else print (v[NR/2]+v[NR/2+1])/2 }'
+}
+
+# perf counters for a command, as "event=value event=value ..."
+counters() {
+	$pin perf stat -x, -e "$perf_events" "$@" 2>&1 > /dev/null | awk -F, '$1 ~ /^[0-9]+$/ { printf "%s=%s ", $3, $1 }'
+}
+
+echo "# building and stamping in $dir"
+printf "%-10s %12s %12s %9s\n" program orig_s stamped_s slowdown
+
+for p in "${programs[@]}"; do
+	if [[ -f "$src/$p.c" ]]; then
+		$CC $CFLAGS -o "$dir/$p.orig" "$src/$p.c" || continue
+	elif [[ -f "$src/$p.cpp" ]]; then
+		$CXX $CFLAGS -o "$dir/$p.orig" "$src/$p.cpp" || continue
+	else
+		echo "$p: no such benchmark"
+		continue
+	fi
+
+	# stamp in a directory of its own, as the rewriter leaves a lot behind.
+	mkdir -p "$dir/$p.work"
+	( cd "$dir/$p.work" && $PSZ "$dir/$p.orig" "$dir/$p.stamped" -c stack_stamp=on --step-option "stack_stamp:$ss_opts" > psz.log 2>&1 )
+	if [[ ! -x "$dir/$p.stamped" ]]; then
+		echo "$p: stamping failed, see $dir/$p.work/psz.log"
+		continue
+	fi
+
+	# the stamped program had better compute the same thing.
+	if ! cmp -s <("$dir/$p.orig") <("$dir/$p.stamped"); then
+		echo "$p: stamped output differs from the original!"
+		continue
+	fi
+
+	# alternate the runs, so drift affects both equally.
+	orig=() stamped=()
+	for ((i=0; i<reps; i++)); do
+		orig+=($(time_one "$dir/$p.orig"))
+		stamped+=($(time_one "$dir/$p.stamped"))
+	done
+	orig_s=$(median "${orig[@]}")
+	stamped_s=$(median "${stamped[@]}")
+	printf "%-10s %12s %12s %8.3fx\n" "$p" "$orig_s" "$stamped_s" "$(awk -v o="$orig_s" -v s="$stamped_s" 'BEGIN { print s/o }')"
+
+	if [[ -n "$perf_events" ]]; then
+		echo "    orig:    $(counters "$dir/$p.orig")"
+		echo "    stamped: $(counters "$dir/$p.stamped")"
+	fi
+done
@@ -0,0 +1,60 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+//
+// Switch dispatch:  a dense switch compiles to an indirect jump through a table, whose
+// targets stay in the function (a little interpreter).
+//
+#include <stdio.h>
+#include <stdlib.h>
+
+__attribute__((noinline)) static unsigned run(const unsigned char* code, unsigned len, unsigned acc)
+{
+	for(unsigned pc=0; pc<len; pc++)
+	{
+		switch(code[pc])
+		{
+			case 0:  acc+=1;             break;
+			case 1:  acc*=3;             break;
+			case 2:  acc^=acc>>5;        break;
+			case 3:  acc-=7;             break;
+			case 4:  acc=acc<<1|acc>>31; break;
+			case 5:  acc+=pc;            break;
+			case 6:  acc^=0x5a5a5a5au;   break;
+			case 7:  acc=~acc;           break;
+			default: acc=0;              break;
+		}
+	}
+	return acc;
+}
+
+int main(int argc, char* argv[])
+{
+	const unsigned long iters = argc>1 ? strtoul(argv[1], NULL, 0) : 1000000ul;
+	unsigned char code[256];
+	unsigned seed=12345;
+	for(unsigned i=0; i<sizeof(code); i++)
+	{
+		seed=seed*1103515245u+12345u;
+		code[i]=(seed>>16)%8;
+	}
+
+	unsigned acc=1;
+	for(unsigned long i=0; i<iters; i++)
+		acc=run(code, sizeof(code), acc);
+	printf("switch=%u\n", acc);
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+//
+// Tail-call chains:  at -O2 each hop is a jmp to the next function, so the stamps are on
+// tail jumps rather than returns.
+//
+#include <stdio.h>
+#include <stdlib.h>
+
+__attribute__((noinline)) static unsigned hop4(unsigned x, unsigned n);
+
+__attribute__((noinline)) static unsigned hop1(unsigned x, unsigned n) { return n==0 ? x : hop4(x*3+1, n-1); }
+__attribute__((noinline)) static unsigned hop2(unsigned x, unsigned n) { return hop1(x^0x55u, n); }
+__attribute__((noinline)) static unsigned hop3(unsigned x, unsigned n) { return hop2(x+7, n); }
+__attribute__((noinline)) static unsigned hop4(unsigned x, unsigned n) { return hop3(x>>1 | x<<31, n); }
+
+__attribute__((noinline)) static unsigned chain(unsigned x)
+{
+	return hop4(x, 8);
+}
+
+int main(int argc, char* argv[])
+{
+	const unsigned long iters = argc>1 ? strtoul(argv[1], NULL, 0) : 10000000ul;
+	unsigned acc=1;
+	for(unsigned long i=0; i<iters; i++)
+		acc+=chain(acc);
+	printf("tailcall=%u\n", acc);
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+//
+// Virtual calls in a loop:  indirect calls to small stamped methods.
+//
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <stdlib.h>
+
+using namespace std;
+
+struct Shape_t
+{
+	virtual ~Shape_t() { }
+	virtual unsigned area(unsigned scale) const = 0;
+};
+
+struct Square_t : public Shape_t
+{
+	unsigned side;
+	Square_t(unsigned s) : side(s) { }
+	unsigned area(unsigned scale) const override { return side*side*scale; }
+};
+
+struct Rect_t : public Shape_t
+{
+	unsigned w, h;
+	Rect_t(unsigned p_w, unsigned p_h) : w(p_w), h(p_h) { }
+	unsigned area(unsigned scale) const override { return w*h*scale; }
+};
+
+struct Tri_t : public Shape_t
+{
+	unsigned b, h;
+	Tri_t(unsigned p_b, unsigned p_h) : b(p_b), h(p_h) { }
+	unsigned area(unsigned scale) const override { return b*h*scale/2; }
+};
+
+int main(int argc, char* argv[])
+{
+	const auto iters = argc>1 ? strtoul(argv[1], NULL, 0) : 100000000ul;
+
+	// mix the types so the calls are not trivially predicted.
+	auto shapes=vector<unique_ptr<Shape_t>>();
+	for(auto i=0u; i<64; i++)
+	{
+		switch((i*7)%3)
+		{
+			case 0:  shapes.push_back(unique_ptr<Shape_t>(new Square_t(i))); break;
+			case 1:  shapes.push_back(unique_ptr<Shape_t>(new Rect_t(i, i+1))); break;
+			default: shapes.push_back(unique_ptr<Shape_t>(new Tri_t(i, i+2))); break;
+		}
+	}
+
+	auto acc=0u;
+	for(auto i=0ul; i<iters; i++)
+		acc+=shapes[i%shapes.size()]->area(acc&7);
+	cout << "vcall=" << acc << endl;
+	return 0;
+}
@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+#   Copyright 2017-2019 University of Virginia
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+#
+
+#
+# Time stack stamping on synthetic IRs of growing size, and print a scaling curve.
+#
+# usage: scaling.sh <64-bit program> [sizes...] [-- extra stack_stamp_bench options]
+#
+# e.g.:  scaling.sh /bin/ls 1000 10000 100000 1000000 -- --jobs 8 --eh-programs 1000
+#
+# Each run adds the synthetic functions to the program's IR via the stack_stamp_bench step
+# (which never writes the IR back), then collects the ATTRIBUTE lines the step logged.
+# The last column is time-per-function relative to the smallest run;  it should stay near 1.
+# A ratio that grows with size means some phase has gone superlinear.
+#
+# Environment:
+#    PSZ        how to run the rewriter (required, as set up by the zipr image)
+#
+
+if [[ $# -lt 1 ]]; then
+	echo "usage: $0 <64-bit program> [sizes...] [-- extra stack_stamp_bench options]"
+	exit 1
+fi
+
+if [[ -z "$PSZ" ]]; then
+	echo "PSZ is not set, run this from the zipr image."
+	exit 1
+fi
+
+program=$(realpath "$1")
+shift
+
+sizes=()
+while [[ $# -gt 0 && "$1" != "--" ]]; do
+	sizes+=("$1")
+	shift
+done
+[[ "$1" == "--" ]] && shift
+extra="$*"
+[[ ${#sizes[@]} -eq 0 ]] && sizes=(1000 10000 100000 1000000)
+
+phases="sort feasibility stamp eh_update retarget cleanup"
+base_us=""
+
+printf "%10s %12s %10s" functions instructions execute_s
+for p in $phases; do printf " %12s" "$p"; done
+printf " %10s %8s\n" us_per_fn ratio
+
+for n in "${sizes[@]}"; do
+	dir=$(mktemp -d -t ss_scaling.XXXXXX)
+	( cd "$dir" && $PSZ "$program" "$dir/out.exe" -c stack_stamp_bench=on \
+		--step-option "stack_stamp_bench:--functions $n $extra" > "$dir/psz.log" 2>&1 )
+
+	log=$(ls "$dir"/peasoup_executable_dir.*/logs/stack_stamp_bench.log 2>/dev/null | head -1)
+	if [[ -z "$log" ]]; then
+		echo "$n: no benchmark log, see $dir/psz.log"
+		continue
+	fi
+
+	attr() { grep -h "ATTRIBUTE $1=" "$log" | tail -1 | cut -d= -f2 ; }
+
+	us=$(attr Stack_Stamp_Bench::execute_us_per_function)
+	[[ -z "$base_us" ]] && base_us=$us
+
+	printf "%10s %12s %10s" "$n" "$(attr Stack_Stamp_Bench::instructions_in_ir)" "$(attr Stack_Stamp_Bench::execute_seconds)"
+	for p in $phases; do printf " %12s" "$(attr Stack_Stamping::phase_${p}_seconds)"; done
+	printf " %10s %8.2f\n" "$us" "$(awk -v u="$us" -v b="$base_us" 'BEGIN { print u/b }')"
+
+	rm -rf "$dir"
+done
@@ -0,0 +1,210 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <stdlib.h>
+#include <chrono>
+#include <irdb-core>
+#include <getopt.h>
+#include "ss.hpp"
+#include "synth_ir.hpp"
+
+using namespace std;
+using namespace IRDB_SDK;
+using namespace Stamper;
+
+#define ALLOF(a) begin(a), end(a)
+
+//
+// A thanos-enabled driver that adds synthetic functions to the main file's IR and times
+// stack stamping on them.  The IR is never written back; this step always "fails" so that
+// the synthetic functions cannot end up in a real executable.
+//
+class StackStampBenchDriver_t : public TransformStep_t
+{
+	public:
+
+		//
+		// required overrride: how to parse your arguments
+		//
+		int parseArgs(const vector<string> step_args) override
+		{
+			// convert to argc/argv format for parsing wth getopts, see ss_driver.cpp
+			auto argv = vector<char*>({const_cast<char*>("libstack_stamp_bench.so")});
+			transform(ALLOF(step_args), back_inserter(argv), [](const string &s) -> char* { return const_cast<char*>(s.c_str()); } );
+			const auto argc=argv.size();
+
+			// declare getopts values
+			const auto short_opts="f:i:r:c:t:b:S:Z:e:R:s:j:?h";
+			struct option long_options[] = {
+				{"functions", required_argument, 0, 'f'},
+				{"insns", required_argument, 0, 'i'},
+				{"returns", required_argument, 0, 'r'},
+				{"calls", required_argument, 0, 'c'},
+				{"tail-jump-pct", required_argument, 0, 't'},
+				{"ib-pct", required_argument, 0, 'b'},
+				{"icfs-sets", required_argument, 0, 'S'},
+				{"icfs-size", required_argument, 0, 'Z'},
+				{"eh-programs", required_argument, 0, 'e'},
+				{"seed", required_argument, 0, 'R'},
+				{"stamp-value", required_argument, 0, 's'},
+				{"jobs", required_argument, 0, 'j'},
+				{"help", no_argument, 0, 'h'},
+				{"usage", no_argument, 0, '?'},
+				{0,0,0,0}
+			};
+
+			// Parse options for the benchmark
+			while(true)
+			{
+				auto c = getopt_long(argc, &argv[0], short_opts, long_options, nullptr);
+				if(c == -1) break;
+				switch(c)
+				{
+					case 'f': params.functions            = strtoul(optarg,NULL,0); break;
+					case 'i': params.insns_per_function   = strtoul(optarg,NULL,0); break;
+					case 'r': params.returns_per_function = strtoul(optarg,NULL,0); break;
+					case 'c': params.calls_per_function   = strtoul(optarg,NULL,0); break;
+					case 't': params.tail_jump_pct        = strtoul(optarg,NULL,0); break;
+					case 'b': params.ib_pct               = strtoul(optarg,NULL,0); break;
+					case 'S': params.icfs_sets            = strtoul(optarg,NULL,0); break;
+					case 'Z': params.icfs_size            = strtoul(optarg,NULL,0); break;
+					case 'e': params.eh_programs          = strtoul(optarg,NULL,0); break;
+					case 'R': params.seed                 = strtoul(optarg,NULL,0); break;
+					case 's': stamp_value                 = strtoul(optarg,NULL,0); break;
+					case 'j': 
+					{
+						auto end=(char*)nullptr;
+						jobs=strtoul(optarg,&end,0);
+						if(optarg[0]=='-' || *end!='\0' || jobs==0)
+						{
+							cerr<<"Bad number of jobs: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						break;
+					}
+					case '?':
+					case 'h':
+						usage(argv[0]);
+						return 1;
+						break;
+					default:
+						break;
+				}
+			}
+
+			return 0;
+		}
+
+		//
+		// required override:  build the synthetic IR and time the transform on it
+		//
+		int executeStep() override
+		{
+			using Clock_t = chrono::steady_clock;
+			const auto seconds=[](const Clock_t::time_point& start)
+				{ return chrono::duration<double>(Clock_t::now()-start).count(); };
+
+			try
+			{
+				auto firp=getMainFileIR();
+				if(firp->getArchitectureBitWidth()!=64)
+				{
+					cerr << program_name << ": synthetic IRs are x86-64, benchmark a 64-bit program." << endl;
+					return 2;
+				}
+
+				// generate
+				const auto gen_start=Clock_t::now();
+				const auto funcs=SyntheticIR_t(firp, params).generate();
+				const auto gen_seconds=seconds(gen_start);
+
+				// and stamp.  the transform reports its own per-phase times, quietly.
+				const auto stamp_start=Clock_t::now();
+				const auto success=StackStamp_t(firp, stamp_value, LogLevel_t::Summary, jobs).execute();
+				const auto stamp_seconds=seconds(stamp_start);
+
+				cout << "# ATTRIBUTE Stack_Stamp_Bench::functions_generated="      << dec << funcs.size()                          << endl;
+				cout << "# ATTRIBUTE Stack_Stamp_Bench::functions_in_ir="          << dec << firp->getFunctions().size()           << endl;
+				cout << "# ATTRIBUTE Stack_Stamp_Bench::instructions_in_ir="       << dec << firp->getInstructions().size()        << endl;
+				cout << "# ATTRIBUTE Stack_Stamp_Bench::generate_seconds="         << fixed << gen_seconds                         << endl;
+				cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_seconds="          << fixed << stamp_seconds                       << endl;
+				cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_us_per_function="  << fixed << stamp_seconds*1e6/max(funcs.size(), size_t(1)) << endl;
+				cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_succeeded="        << boolalpha << success                         << endl;
+			}
+			catch (const DatabaseError_t &dberr)
+			{
+				cerr << program_name << ": Unexpected database error: " << dberr << endl;
+			}
+			catch (...)
+			{
+				cerr << program_name << ": Unexpected error" << endl;
+			}
+
+			// never let the synthetic IR be written back.
+			return 2;
+		}
+
+		//
+		// required override: what is this step's name?
+		//
+		string getStepName(void) const override
+		{
+			return program_name;
+		}
+
+	private:
+	// data
+		const string program_name = string("stack_stamp_bench");   // this programs name
+		SynthParams_t params;                                      // what IR to generate
+		StampValue_t stamp_value  = 0x12345678;                    // a fixed stamp, so runs are comparable
+		size_t jobs               = 1;                             // how many analysis threads? (capped at one per core)
+
+	// methods
+
+		//
+		// optional print usage for this program
+		//
+		void usage(const string& name)
+		{
+			cerr<<"Usage: "<<name<<endl;
+			cerr<<"\t--functions <n>               How many synthetic functions to add (1000)."<<endl;
+			cerr<<"\t--insns <n>                   Instructions per function (16).             "<<endl;
+			cerr<<"\t--returns <n>                 Returns per function (1).                   "<<endl;
+			cerr<<"\t--calls <n>                   Direct calls per function (2).              "<<endl;
+			cerr<<"\t--tail-jump-pct <n>           Percent of functions ending in a jmp (10).  "<<endl;
+			cerr<<"\t--ib-pct <n>                  Percent of functions ending in an IB (5).   "<<endl;
+			cerr<<"\t--icfs-sets <n>               Distinct ICFS sets (16).                    "<<endl;
+			cerr<<"\t--icfs-size <n>               Targets per ICFS set (64).                  "<<endl;
+			cerr<<"\t--eh-programs <n>             Distinct shared EH programs (32).           "<<endl;
+			cerr<<"\t--seed <n>                    Random seed (1).                            "<<endl;
+			cerr<<"\t--stamp-value <value>         Stamp value (0x12345678).                   "<<endl;
+			cerr<<"\t--jobs <n>                    Analysis threads (1, at most one per core). "<<endl;
+			cerr<<"--help,--usage,-?,-h            Display this message                        "<<endl;
+		}
+
+};
+
+
+//
+// Required interface:  libstack_stamp_bench.so needs to have this factory function so thanos can create the transform step object
+//
+extern "C"
+shared_ptr<TransformStep_t> getTransformStep(void)
+{
+        return shared_ptr<TransformStep_t>(new StackStampBenchDriver_t());
+}
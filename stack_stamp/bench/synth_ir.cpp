@@ -0,0 +1,258 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <assert.h>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include "synth_ir.hpp"
+
+using namespace std;
+using namespace IRDB_SDK;
+using namespace Stamper;
+
+#define ALLOF(a) begin(a), end(a)
+
+//
+// The x86-64 machine code we build functions from.  Branch displacements are left as zero,
+// as the IR records branch targets separately from the bits.
+//
+static const auto push_rbp    = string("\x55", 1);                      // push rbp
+static const auto mov_rbp_rsp = string("\x48\x89\xe5", 3);              // mov rbp, rsp
+static const auto mov_eax_ebx = string("\x89\xd8", 2);                  // mov eax, ebx
+static const auto add_eax_1   = string("\x83\xc0\x01", 3);              // add eax, 1
+static const auto je_rel32    = string("\x0f\x84\x00\x00\x00\x00", 6);  // je <target>
+static const auto call_rel32  = string("\xe8\x00\x00\x00\x00", 5);      // call <target>
+static const auto jmp_rel32   = string("\xe9\x00\x00\x00\x00", 5);      // jmp <target>
+static const auto jmp_rax     = string("\xff\xe0", 2);                  // jmp rax
+static const auto pop_rbp     = string("\x5d", 1);                      // pop rbp
+static const auto ret         = string("\xc3", 1);                      // ret
+
+//
+// How to create a SyntheticIR_t object. (i.e., the constructor)
+//
+SyntheticIR_t::SyntheticIR_t(FileIR_t* p_firp, const SynthParams_t& p_params)
+	:
+	m_firp(p_firp),
+	m_params(p_params),
+	m_rng(p_params.seed)
+{
+	// sanity, we generate x86-64 code.
+	assert(m_firp->getArchitectureBitWidth()==64);
+}
+
+//
+// Add a new instruction to f, with prev falling through to it.  Instructions are laid out one after
+// another in the order they're made, so profiles (and address ranges) can refer to them.
+//
+Instruction_t* SyntheticIR_t::add_insn(Function_t* f, const string& bits, Instruction_t* prev)
+{
+	const auto addr=m_firp->addNewAddress(m_firp->getFile()->getBaseID(), m_next_addr);
+	m_next_addr+=bits.size();
+	const auto insn=m_firp->addNewInstruction(addr, f, bits, "synthetic");
+	insn->setFunction(f);
+	if(prev)
+		prev->setFallthrough(insn);
+	return insn;
+}
+
+//
+// Create the EH programs that the functions share.  Each has the usual x86-64 CIE program
+// and an FDE program that is made distinct by its CFA offset.
+//
+void SyntheticIR_t::make_eh_programs()
+{
+	const auto cie_program=EhProgramListing_t(
+		{
+			string("\x0c\x07\x08", 3),    // DW_CFA_def_cfa rsp+8
+			string("\x90\x01", 2)         // DW_CFA_offset r16 (rip) at cfa-8
+		});
+
+	for(auto i=size_t(0); i<m_params.eh_programs; i++)
+	{
+		// DW_CFA_def_cfa_offset takes a ULEB128 operand
+		auto offset=string("\x0e", 1);
+		auto value=16+8*i;
+		do
+		{
+			const auto byte=(uint8_t)(value & 0x7f);
+			value >>= 7;
+			offset += (char)(value ? (byte | 0x80) : byte);
+		} while(value);
+
+		const auto fde_program=EhProgramListing_t(
+			{
+				string("\x41", 1),        // DW_CFA_advance_loc 1
+				offset,                   // DW_CFA_def_cfa_offset 16+8*i
+				string("\x86\x02", 2)     // DW_CFA_offset r6 (rbp) at cfa-16
+			});
+
+		m_eh_pgms.push_back(m_firp->addEhProgram(nullptr, 1, -8, 16, 8, cie_program, fde_program));
+	}
+}
+
+//
+// Create the ICFS sets that the indirect branches share.  Like a PLT or a table of function
+// pointers, each set's targets are entries of other functions.
+//
+void SyntheticIR_t::make_icfs_sets()
+{
+	for(auto i=size_t(0); i<m_params.icfs_sets; i++)
+	{
+		auto targets=InstructionSet_t();
+		for(auto j=size_t(0); j<m_params.icfs_size; j++)
+			targets.insert(random_entry(nullptr));
+		m_icfs_sets.push_back(m_firp->addNewICFS(nullptr, targets, iasAnalysisComplete));
+	}
+}
+
+//
+// Pick the entry of a random function, other than not_this.
+//
+Instruction_t* SyntheticIR_t::random_entry(Function_t* not_this)
+{
+	assert(!m_funcs.empty());
+	while(true)
+	{
+		const auto f=m_funcs[m_rng() % m_funcs.size()];
+		if(f!=not_this || m_funcs.size()==1)
+			return f->getEntryPoint();
+	}
+}
+
+//
+// Fill in a function that has only its entry so far.  The function is split into one block
+// per return.  Each block but the last starts with a conditional jump to the next block, so
+// every block is reachable.  The last block may end in a tail jump or an indirect branch instead
+// of a return.
+//
+// Leaf functions (see SynthParams_t::leaf_pct) have no frame, no calls, and always return.
+// Functions that never return (see SynthParams_t::noreturn_pct) end each block with a call instead.
+//
+void SyntheticIR_t::make_body(Function_t* f)
+{
+	const auto entry=f->getEntryPoint();
+	const auto eh_pgm=m_eh_pgms.empty() ? nullptr : m_eh_pgms[m_rng() % m_eh_pgms.size()];
+	const auto blocks=max(m_params.returns_per_function, size_t(1));
+
+	// only roll for leaves if asked, so the other choices for a seed don't change.
+	const auto is_leaf= m_params.leaf_pct>0 && m_rng() % 100 < m_params.leaf_pct;
+	const auto is_noreturn= !is_leaf && m_params.noreturn_pct>0 && m_rng() % 100 < m_params.noreturn_pct;
+
+	// the prologue (leaves replace the entry's push with filler), and the number of instructions left for the blocks
+	auto insns=InstructionSet_t({entry});
+	if(is_leaf)
+		entry->setDataBits(mov_eax_ebx);
+	auto prev=add_insn(f, is_leaf ? add_eax_1 : mov_rbp_rsp, entry);
+	insns.insert(prev);
+	const auto per_block=max(m_params.insns_per_function, size_t(4)) / blocks;
+	auto calls_left= is_leaf ? size_t(0) : m_params.calls_per_function;
+
+	// how does this function end?
+	const auto roll=m_rng() % 100;
+	const auto ends_in_tail_jump = !is_leaf && !is_noreturn && roll < m_params.tail_jump_pct;
+	const auto ends_in_ib        = !is_leaf && !is_noreturn && !ends_in_tail_jump && roll < m_params.tail_jump_pct+m_params.ib_pct && !m_icfs_sets.empty();
+
+	auto pending_je=(Instruction_t*)nullptr;
+	for(auto b=size_t(0); b<blocks; b++)
+	{
+		const auto last_block = b+1==blocks;
+
+		// a block starts with a jump to the next block, or with filler if it's the last.
+		const auto first=add_insn(f, last_block ? mov_eax_ebx : je_rel32, prev);
+		insns.insert(first);
+		if(pending_je)
+			pending_je->setTarget(first);
+		pending_je = last_block ? nullptr : first;
+		prev=first;
+
+		// then some filler and calls
+		for(auto i=size_t(3); i<per_block; i++)
+		{
+			const auto do_call = calls_left>0 && (m_rng() % per_block) < m_params.calls_per_function;
+			prev=add_insn(f, do_call ? call_rel32 : (i%2 ? mov_eax_ebx : add_eax_1), prev);
+			insns.insert(prev);
+			if(do_call)
+			{
+				prev->setTarget(random_entry(f));
+				calls_left--;
+			}
+		}
+
+		// and the epilogue
+		prev=add_insn(f, is_leaf ? mov_eax_ebx : pop_rbp, prev);
+		insns.insert(prev);
+		if(is_noreturn)
+		{
+			// e.g., a call to abort, so nothing follows
+			const auto exit=add_insn(f, call_rel32, prev);
+			exit->setTarget(random_entry(f));
+			insns.insert(exit);
+		}
+		else if(last_block && ends_in_tail_jump)
+		{
+			const auto exit=add_insn(f, jmp_rel32, prev);
+			exit->setTarget(random_entry(f));
+			insns.insert(exit);
+		}
+		else if(last_block && ends_in_ib)
+		{
+			const auto exit=add_insn(f, jmp_rax, prev);
+			exit->setIBTargets(m_icfs_sets[m_rng() % m_icfs_sets.size()]);
+			insns.insert(exit);
+		}
+		else
+		{
+			insns.insert(add_insn(f, ret, prev));
+		}
+
+		// the next block is only reached via the conditional jump.
+		prev=nullptr;
+	}
+
+	// every instruction in the function shares one EH program
+	for(const auto insn : insns)
+		insn->setEhProgram(eh_pgm);
+
+	f->setInstructions(insns);
+}
+
+//
+// Generate the synthetic functions.  The entries are created first, so that calls, tail jumps
+// and ICFS sets can refer to any function.
+//
+FunctionSet_t SyntheticIR_t::generate()
+{
+	m_funcs.reserve(m_params.functions);
+	for(auto i=size_t(0); i<m_params.functions; i++)
+	{
+		stringstream name; // stringstream has no copy constructor, cannot use auto style decls.
+		name << "synth_" << setw(8) << setfill('0') << i;
+
+		const auto entry=add_insn(nullptr, push_rbp, nullptr);
+		const auto f=m_firp->addNewFunction(name.str(), entry);
+		entry->setFunction(f);
+		m_funcs.push_back(f);
+	}
+
+	make_eh_programs();
+	make_icfs_sets();
+
+	for(const auto f : m_funcs)
+		make_body(f);
+
+	return FunctionSet_t(ALLOF(m_funcs));
+}
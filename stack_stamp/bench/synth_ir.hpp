@@ -0,0 +1,90 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _LIBTRANSFORM_SYNTH_IR_H
+#define _LIBTRANSFORM_SYNTH_IR_H
+
+#include <irdb-core>
+#include <random>
+
+//
+// using a namespace for code readability
+//
+namespace Stamper
+{
+	// std and IRDB namespaces needed
+	using namespace std;
+	using namespace IRDB_SDK;
+
+	//
+	// The knobs for generating a synthetic IR.  The defaults produce functions that look
+	// roughly like small compiled C functions.
+	//
+	struct SynthParams_t
+	{
+		size_t functions            = 1000;   // how many functions to generate
+		size_t insns_per_function   = 16;     // roughly how many instructions in each function
+		size_t returns_per_function = 1;      // how many ret instructions in each function
+		size_t calls_per_function   = 2;      // how many direct calls to other functions in each function
+		size_t tail_jump_pct        = 10;     // percent of functions that end with a tail jump
+		size_t ib_pct               = 5;      // percent of functions that end with an indirect branch
+		size_t icfs_sets            = 16;     // how many distinct ICFS sets the indirect branches share
+		size_t icfs_size            = 64;     // how many targets in each ICFS set
+		size_t eh_programs          = 32;     // how many distinct EH programs the functions share
+		size_t leaf_pct             = 0;      // percent of functions that are frameless leaves (no calls, no stack use)
+		size_t noreturn_pct         = 0;      // percent of functions that end every block with a call that doesn't return
+		unsigned seed               = 1;      // seed for the random choices, so runs are repeatable
+	};
+
+	//
+	// A class to add synthetic functions to an IR, so the transform can be timed on IRs of any size.
+	// The instructions are real x86-64 machine code, so they decode as they would in a real program.
+	//
+	class SyntheticIR_t
+	{
+		public:
+			SyntheticIR_t(FileIR_t* p_firp, const SynthParams_t& p_params);
+
+			// add the functions to the IR, and return them
+			FunctionSet_t generate();
+
+		private:
+		// methods
+
+			// create a new instruction with the given bits in f, falling through from prev (if any)
+			Instruction_t* add_insn(Function_t* f, const string& bits, Instruction_t* prev);
+
+			// create the shared EH programs and ICFS sets
+			void make_eh_programs();
+			void make_icfs_sets();
+
+			// fill in the body of a function
+			void make_body(Function_t* f);
+
+			// pick a random function entry, other than the one given
+			Instruction_t* random_entry(Function_t* not_this);
+
+		// data
+			FileIR_t* m_firp;                          // the IR we are adding to
+			SynthParams_t m_params;                    // what to add
+			mt19937 m_rng;                             // random choices
+			vector<Function_t*> m_funcs;               // the functions we've made
+			vector<EhProgram_t*> m_eh_pgms;            // the shared EH programs
+			vector<ICFS_t*> m_icfs_sets;               // the shared ICFS sets
+			VirtualOffset_t m_next_addr = 0x400000;    // where the next instruction goes
+	};
+}
+#endif
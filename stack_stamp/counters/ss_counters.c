@@ -0,0 +1,139 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+/*
+ * Dump the stamp site counters of a program stamped with --counters or --counters-only.
+ *
+ * Preload this into the stamped program:
+ *
+ *     LD_PRELOAD=/path/to/libss_counters.so ./stamped_program
+ *
+ * When the program exits, the counter scoop (see StackStamp_t::finish_counter_scoop) is found
+ * in the program's writable mappings and each site that executed is written as an
+ * "address count" line, to $SS_COUNTERS_OUT or else ss_counters.<pid>.txt.  That is the
+ * format that --profile reads, so a counted run can pick the functions to stamp.
+ *
+ * Programs that leave with _exit or a fatal signal are not dumped.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#define SS_MAGIC      "SS_COUNTERS_V1\0\0"
+#define SS_MAGIC_LEN  16
+#define SS_PAGE       4096
+
+struct ss_site
+{
+	uint64_t address;
+	uint64_t count;
+};
+
+struct ss_counters
+{
+	char            magic[SS_MAGIC_LEN];
+	uint64_t        sites;
+	struct ss_site  site[];
+};
+
+/*
+ * Look for the counter scoop in [start,end), which is readable.  It's page aligned.
+ */
+static const struct ss_counters* find_in(uintptr_t start, uintptr_t end)
+{
+	for(uintptr_t page=start; page+sizeof(struct ss_counters) <= end; page+=SS_PAGE)
+	{
+		const struct ss_counters* c=(const struct ss_counters*)page;
+		if(memcmp(c->magic, SS_MAGIC, SS_MAGIC_LEN)!=0)
+			continue;
+		if(page + sizeof(*c) + c->sites*sizeof(struct ss_site) > end)
+			continue;
+		return c;
+	}
+	return NULL;
+}
+
+/*
+ * Find the counter scoop in the main program's writable mappings.  The scoop may also be in
+ * the anonymous mapping that directly follows one of them, if the loader put it there.
+ */
+static const struct ss_counters* find_counters(void)
+{
+	char exe[PATH_MAX];
+	const ssize_t len=readlink("/proc/self/exe", exe, sizeof(exe)-1);
+	if(len<0)
+		return NULL;
+	exe[len]='\0';
+
+	FILE* maps=fopen("/proc/self/maps", "r");
+	if(!maps)
+		return NULL;
+
+	const struct ss_counters* found=NULL;
+	uintptr_t prev_end=0;
+	int prev_is_exe=0;
+	char line[PATH_MAX+128];
+	while(!found && fgets(line, sizeof(line), maps))
+	{
+		unsigned long start=0, end=0;
+		char perms[5]="", path[PATH_MAX]="";
+		if(sscanf(line, "%lx-%lx %4s %*s %*s %*s %4095s", &start, &end, perms, path) < 3)
+			continue;
+
+		const int is_exe= strcmp(path, exe)==0;
+		const int is_anon= path[0]=='\0';
+		const int writable= perms[0]=='r' && perms[1]=='w';
+		if(writable && (is_exe || (is_anon && prev_is_exe && prev_end==start)))
+			found=find_in(start, end);
+
+		prev_end=end;
+		prev_is_exe=is_exe;
+	}
+	fclose(maps);
+	return found;
+}
+
+__attribute__((destructor))
+static void ss_dump_counters(void)
+{
+	const struct ss_counters* c=find_counters();
+	if(!c)
+		return;
+
+	char name[PATH_MAX];
+	const char* out=getenv("SS_COUNTERS_OUT");
+	if(!out || !*out)
+	{
+		snprintf(name, sizeof(name), "ss_counters.%d.txt", (int)getpid());
+		out=name;
+	}
+
+	FILE* f=fopen(out, "w");
+	if(!f)
+	{
+		fprintf(stderr, "ss_counters: cannot write %s\n", out);
+		return;
+	}
+	fprintf(f, "# stack stamp site counters: address count\n");
+	for(uint64_t i=0; i<c->sites; i++)
+		if(c->site[i].count)
+			fprintf(f, "0x%llx %llu\n", (unsigned long long)c->site[i].address, (unsigned long long)c->site[i].count);
+	fclose(f);
+}
@@ -15,9 +15,14 @@
 */
 
 #include <assert.h>
-#include <sstream>
+#include <string.h>
 #include <iomanip>
 #include <algorithm>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <cmath>
+#include <sys/resource.h>
 #include "ss.hpp"
 
 using namespace std;
@@ -42,58 +47,296 @@ using namespace Stamper;
 //
 #define ALLOF(s) begin(s), end(s)
 
-// 
-// Useful  method to find relocations of a given type. 
-// 
-static Relocation_t* findRelocation(Instruction_t* insn, const string& type)
-{
-	const auto &relocs = insn->getRelocations();
-	auto find_it=find_if(ALLOF(relocs), [&](const Relocation_t* reloc)
-	                     {
-	                     	return (reloc->getType()==type);
-	                     });
-	return (find_it==end(relocs)) ? *find_it : NULL;
-}
-
 // 
 // How to create a StackStamp_t object. (i.e., the constructor)
+// More analysis threads than cores would just contend, so p_jobs is capped at the core count.
 // 
-StackStamp_t::StackStamp_t(FileIR_t *p_variantIR, StampValue_t sv, bool p_verbose)
+StackStamp_t::StackStamp_t(FileIR_t *p_variantIR, StampValue_t sv, LogLevel_t p_log_level, size_t p_jobs)
 	: 
 	Transform_t(p_variantIR),
 	m_stamp_value(sv),
-	m_verbose(p_verbose)
+	m_log(p_log_level),
+	m_cie_stamp_rule(has_global_stamp()),
+	m_jobs(max(size_t(1), min(p_jobs, (size_t)max(1u, thread::hardware_concurrency())))),
+	m_stamp_rule(stamp_rule(sv)),
+	m_sp_name(getFileIR()->getArchitectureBitWidth()==64 ? "rsp" : "esp")
 {
 }
 
 // 
 // get the stamp value for this function  -- for now, just a constant vaule.  Maybe someday later we stamp differnetly.
 // 
-StampValue_t StackStamp_t::get_stamp(Function_t* f)
+StampValue_t StackStamp_t::get_stamp(Function_t* /*f*/) const
 {
 	return m_stamp_value;
 }
 
 // 
-// A method to check whether a function is stampable. 
+// With --consolidate-returns, a function with many returns gets one stamp per distinct return encoding 
+// (usually just one) instead of one per return:  the first return of each encoding is stamped, and the 
+// others become jumps to that stamp.  A jump is bigger than the return it replaces, so this is only done 
+// if it saves bytes overall.  And as the jump costs time on every return, with a profile it is only done 
+// in functions that have no samples.
+//
+// Returns true if it took care of the function's returns, otherwise apply_stamps stamps each one.
+//
+bool StackStamp_t::consolidate_returns(Function_t* f, const InsnClassList_t& sites, const string& bits)
+{
+	// counters count each site, so leave them be.
+	if(m_consolidate_returns==0 || m_count_mode!=CountMode_t::None)
+		return false;
+
+	// the returns, by encoding
+	auto groups=map<string, vector<Instruction_t*> >();
+	auto returns=size_t(0);
+	for(const auto &site : sites)
+	{
+		if(site.kind!=ExitKind_t::Return) 
+			continue;
+		groups[site.insn->getDataBits()].push_back(site.insn);
+		returns++;
+	}
+	if(returns<m_consolidate_returns)
+		return false;
+
+	// hot functions keep their returns.
+	if(m_profile && m_profile_samples.find(f)!=m_profile_samples.end())
+		return false;
+
+	// Stamping each return costs a stamp apiece.  Sharing costs a stamp per encoding, plus the difference 
+	// between a jmp rel32 and a return for each of the others.
+	const auto jmp_rel32=string("\xe9\x00\x00\x00\x00", 5);
+	auto saved=int64_t(0);
+	for(const auto &group : groups)
+		saved += int64_t(group.second.size()-1) * (int64_t(bits.size()) - int64_t(jmp_rel32.size()) + int64_t(group.first.size()));
+	if(saved<=0)
+		return false;
+
+	for(const auto &group : groups)
+	{
+		// stamp the first, after which it's the stamp (followed by the return) ...
+		const auto shared=group.second.front();
+		SS_LOG(m_log, LogLevel_t::Site) << "Stamping shared return" << endl;
+		stamp(f, shared, bits);
+
+		// ... and make the rest jumps to it.  A direct jump has no indirect targets, so drop the 
+		// return's ICFS (the shared return keeps its own).
+		for(auto it=next(group.second.begin()); it!=group.second.end(); ++it)
+		{
+			const auto jump=*it;
+			jump->setDataBits(jmp_rel32);
+			jump->setTarget(shared);
+			jump->setIBTargets(nullptr);
+			SS_LOG(m_log, LogLevel_t::Site) << "\tJumping from " << hex << jump->getBaseID() << " to the shared return" << endl;
+		}
+	}
+
+	SS_LOG(m_log, LogLevel_t::Function) << "Consolidated " << dec << returns << " returns into " << groups.size() << ", saving " << saved << " bytes" << endl;
+	m_functions_returns_consolidated++;
+	m_returns_consolidated+=returns;
+	m_return_bytes_saved+=saved;
+	return true;
+}
+
 // 
-bool StackStamp_t::can_stamp(Function_t* f)
+// Finish the direct tail jumps that apply_stamps deferred.  If f tail jumps to g, f's stamp would be 
+// removed just before the jump and put right back by g's entry stamp.  When g was stamped with the same 
+// value, skip both:  jump past g's entry stamp (as plan_stamps does for jumps to a function's own 
+// entry) and don't stamp the jump.  Otherwise stamp the jump as usual.
+//
+// This has to wait until every function has been stamped (or not), as g may come after f in the order, 
+// and may not be stamped after all (e.g., if the profile says not to).
+//
+void StackStamp_t::fuse_tail_jumps()
 {
-	// skip any functions with an entry 
-	if(f->getEntryPoint()==NULL) return false;
+	const auto stamp_start=Clock_t::now();
+	for(const auto &tj : m_tail_jumps)
+	{
+		const auto jump=tj.first;
+		const auto f=tj.second;
+		const auto g=jump->getTarget()->getFunction();
 
-	// _start does not have a return address on the stack.
-	if(f->getName() == "_start") return false;
+		const auto stamped_it=m_stamped_entries.find(g);
+		if(stamped_it!=m_stamped_entries.end() && jump->getTarget()==g->getEntryPoint() && get_stamp(g)==get_stamp(f))
+		{
+			SS_LOG(m_log, LogLevel_t::Site) << "Fusing tail jump " << hex << jump->getBaseID() << ":" << jump->getDisassembly() 
+			                                << " with the entry stamp of " << g->getName() << endl;
+			jump->setTarget(stamped_it->second);
+			m_tail_jumps_fused++;
+		}
+		else
+		{
+			SS_LOG(m_log, LogLevel_t::Site) << "Stamping with target!=function" << endl;
+			stamp(f, jump, stamp_encoding(get_stamp(f)));
+		}
+	}
+	end_phase(phStamp, stamp_start);
 
-	// skip functions that might be a plt stub or are so simple they don't count  
-	if(f->getInstructions().size()<=3)  return false; 
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::tail_jumps_fused=" << dec << m_tail_jumps_fused << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::tail_jumps_stamped=" << dec << m_tail_jumps.size()-m_tail_jumps_fused << endl;
+}
+
+// 
+// Does every function get the same stamp?  Keep this in sync with get_stamp.
+// 
+bool StackStamp_t::has_global_stamp() const
+{
+	return true;
+}
+
+// 
+// Count executions of stamp sites.  The counters are incremented with a rip-relative instruction, 
+// so this needs x86-64.
+// 
+void StackStamp_t::setCounting(CountMode_t p_mode)
+{
+	if(p_mode!=CountMode_t::None && getFileIR()->getArchitectureBitWidth()!=64)
+	{
+		SS_LOG(m_log, LogLevel_t::Summary) << "Stamp site counters need x86-64, not counting." << endl;
+		return;
+	}
+	m_count_mode=p_mode;
+}
+
+// 
+// Check whether an instruction might write the return address slot of its function, or let a later 
+// instruction do so.  Used to find leaf functions that needn't be stamped (see is_safe_leaf).  
+// 
+// The check is conservative.  An instruction is considered safe if it:
+//
+//   1) writes memory only below the stack pointer (e.g., the red zone) or through a register other 
+//      than the stack and frame pointers, 
+//   2) does not change the stack pointer, other than by push and pop, and 
+//   3) does not copy the stack or frame pointer anywhere (i.e., does not take a stack address).
+//
+// Writes through other registers are assumed not to point into this function's frame, as 3) 
+// means the function never creates such a pointer itself.  That pushes and pops balance is 
+// checked separately, see is_safe_leaf.
+//
+// Pushing rsp copies it (to be popped anywhere), so is not safe.  Pushing rbp copies it too, which is 
+// only safe while rbp still holds the caller's frame pointer.  That depends on where the push is, so 
+// it is left to classify, see pushes_frame_pointer.
+//
+static bool may_write_frame(const DecodedInstruction_t& di)
+{
+	const auto sp_reg=4u;   // rsp/esp
+	const auto fp_reg=5u;   // rbp/ebp
+	const auto is_frame_reg=[&](const uint32_t reg) { return reg==sp_reg || reg==fp_reg; };
+
+	// anything we can't decode might do anything.
+	if(!di.valid())
+		return true;
+
+	const auto mnemonic=di.getMnemonic();
+	const auto is_push= mnemonic=="push";
+	const auto is_pop = mnemonic=="pop";
+
+	// the stack pointer may only move by push and pop (and the return itself)
+	if(di.setsStackPointer() && !is_push && !is_pop && !di.isReturn())
+		return true;
+
+	for(const auto &op : di.getOperands())
+	{
+		if(op->isMemory())
+		{
+			const auto base_is_frame = op->hasBaseRegister() && is_frame_reg(op->getBaseRegister());
+			const auto index_is_frame= op->hasIndexRegister() && is_frame_reg(op->getIndexRegister());
+
+			// lea of a stack address takes the address
+			if(mnemonic=="lea" && (base_is_frame || index_is_frame))
+				return true;
+
+			// writes relative to the stack pointer are OK only below it. 
+			const auto below_sp= op->hasBaseRegister() && op->getBaseRegister()==sp_reg && !op->hasIndexRegister() && 
+			                     op->getMemoryDisplacement() < 0;
+			if(op->isWritten() && (base_is_frame || index_is_frame) && !below_sp)
+				return true;
+		}
+		else if(op->isRegister() && is_frame_reg(op->getRegNumber()))
+		{
+			// push/pop rbp may only save and restore the caller's frame pointer (see above), but nothing 
+			// may push or pop rsp, or copy either register.
+			if((is_push || is_pop) && op->getRegNumber()==sp_reg)
+				return true;
+			if(!is_push && !is_pop && op->isRead())
+				return true;
+		}
+	}
+
+	return false;
+}
+
+// 
+// Is the instruction a push of the frame pointer?  See may_write_frame.
+//
+static bool pushes_frame_pointer(const DecodedInstruction_t& di)
+{
+	const auto fp_reg=5u;   // rbp/ebp
+	if(!di.valid() || di.getMnemonic()!="push")
+		return false;
+	for(const auto &op : di.getOperands())
+		if(op->isRegister() && op->getRegNumber()==fp_reg)
+			return true;
+	return false;
+}
+
+// 
+// Decode an instruction, or rather, get what we need to know from its decoding.  Decoding is the most 
+// expensive part of this transform (and allocates a lot), but a program has far fewer distinct encodings 
+// than instructions.  So the results are memoized by encoding, in a memo private to the calling thread.
+// 
+const StackStamp_t::DecodeSummary_t& StackStamp_t::decode(Instruction_t* insn, AnalysisScratch_t& scratch)
+{
+	// encodings are at most 15 bytes, which fit in a string without allocating.
+	const auto bits=insn->getDataBits();
+	const auto it=scratch.decodes.find(bits);
+	if(it!=scratch.decodes.end())
+	{
+		scratch.decode_hits++;
+		return it->second;
+	}
+
+	const auto di=DecodedInstruction_t::factory(insn);
+	const auto mnemonic=di->getMnemonic();
+	auto summary=DecodeSummary_t();
+	summary.is_return                =di->isReturn();
+	summary.is_call                  =di->isCall();
+	summary.is_unconditional_branch  =di->isUnconditionalBranch();
+	summary.stack_delta              = mnemonic=="push" ? 1 : mnemonic=="pop" ? -1 : 0;
+	summary.may_write_frame          = m_elide_safe_leaves && may_write_frame(*di);
+	summary.pushes_frame_pointer     = m_elide_safe_leaves && pushes_frame_pointer(*di);
+	scratch.decodes_done++;
+	return scratch.decodes.emplace(bits, summary).first->second;
+}
+
+// 
+// A method to decode each instruction of a function exactly once and record how that instruction
+// exits the function.  Both can_stamp and stamp work from this classification, as decoding is 
+// the most expensive part of this transform.
+//
+// If safe leaves are being elided, this also checks (with the same decode) whether the function 
+// might write its return address slot, see may_write_frame.  Otherwise frame_writes is left true.
+//
+// The classification is scratch, in the calling thread's arena.
+// 
+InsnClassScratch_t StackStamp_t::classify(Function_t* f, bool& frame_writes, AnalysisScratch_t& scratch)
+{
+	auto classes=InsnClassScratch_t(ArenaAllocator_t<InsnClass_t>(scratch.arena));
+	classes.reserve(f->getInstructions().size());
+	frame_writes=true;
+	auto check_frame=m_elide_safe_leaves;
 
-	// check to see if there are odd instructions in this function that we don't want to stamp 
-	const auto fix_call_fallthrough_string=string("fix_call_fallthrough");
 	for(const auto insn :  f->getInstructions())
 	{
 		// decode the insturction
-		const auto di=DecodedInstruction_t::factory(insn);
+		const auto &di=decode(insn, scratch);
+
+		// once one instruction might write the frame, no need to check the rest.  Pushing rbp is only 
+		// allowed as the prologue's save of the caller's frame pointer, i.e., at the entry before 
+		// anything can have written rbp.
+		const auto bad_fp_push= di.pushes_frame_pointer && insn!=f->getEntryPoint();
+		if(check_frame && (di.may_write_frame || bad_fp_push))
+			check_frame=false;
 
 		// grab several fields for later use.
 		const auto target=insn->getTarget();
@@ -107,34 +350,32 @@ bool StackStamp_t::can_stamp(Function_t* f)
 		// is disabled.
 		//
 		// As you won't likely experience a fixed call, further explaination of fixed calls is beyond the scope of the cookbook.
+		// (Fixed calls are found by index_fixed_calls.)
 		//
-		const auto reloc=findRelocation(insn,fix_call_fallthrough_string);
+		const auto is_fixed_call=m_fixed_calls.find(insn)!=m_fixed_calls.end();
+
+		// assume the instruction stays in the function until we learn otherwise
+		auto kind=ExitKind_t::NotAnExit;
 
-		// stamp all returns
-		if(di->isReturn())
+		if(di.is_return)
+		{
+			kind=ExitKind_t::Return;
+		}
+		else if(di.is_call)
 		{
-			// returns are OK
+			kind=ExitKind_t::Call;
 		}
-		else if(di->isCall() || reloc!=NULL)
+		else if(is_fixed_call)
 		{
-			// calls are OK 
-			// do not stamp on calls (fixed or otherwise)
+			kind=ExitKind_t::FixedCall;
 		}
 		// else if it has a target that exits the function, it's likely a tail call (as a jmp insn)
 		else if(target && target->getFunction() != f)
 		{
-			// generally tails calls are OK, but
-			// conditional tail calls?  I just don't want 
-			// figuring out how to instrument them.
-			if(insn->getFallthrough()!=NULL)
-			{
-				// log this anomaly.
-				cout << "Skipping instrumentation of " << f->getName() << " because of cond branch exit.  Insn is: " << insn->getDisassembly() << endl;
-				return false;
-			}
+			kind = insn->getFallthrough()!=NULL ? ExitKind_t::CondTailJump : ExitKind_t::TailJump;
 		}
-		// sanity check indirect cbranches 
-		else if(di->isUnconditionalBranch()   && icfs)
+		// indirect branches may leave, stay, or both.
+		else if(di.is_unconditional_branch   && icfs)
 		{
 			// x86 doesn't have any indirect branches with a fallthrough
 			assert(!insn->getFallthrough());
@@ -143,42 +384,215 @@ bool StackStamp_t::can_stamp(Function_t* f)
 			// What would this mean?  stop so I can figure it out if it ever happens.
 			assert(icfs->size() != 0);
 
+			kind=classify_ib(icfs, f);
+		}
 
-			// like a conditional branch that might leave and might stay,
-			// I don't want to instrument IBs that might leave and might stay.
-			// So, let's check for those
+		classes.push_back({insn,kind});
+	};
 
-			// find a target that leaves
-			const auto leaver=find_if(ALLOF(*icfs), [&](Instruction_t* target){
-			                          return target->getFunction()!=f;
-			                          });
+	if(check_frame)
+		frame_writes=false;
 
-			// find a target that stays
-			const auto stayer=find_if(ALLOF(*icfs), [&](Instruction_t* target){
-			                          return target->getFunction()==f;
-			                          });
-			
-			// calculate booleans about if something might leave
-			const auto might_leave=leaver!=icfs->end();
-			const auto might_stay=stayer!=icfs->end();
+	return classes;
+}
 
-			// if it might not leave, it definitely stays.
-			const auto definitely_stays=!might_leave;
-			const auto definitely_leaves=!might_stay;
+// 
+// A method to check whether a function never uses its return address:  it has no return, no tail 
+// jump, and no indirect branch that leaves.  Such functions (noreturn wrappers like a fatal error 
+// handler, or thread loops) only end by calling something that doesn't return, so a stamp at their 
+// entry would never be checked, and stamped EH programs would just be copies.
+// 
+bool StackStamp_t::never_returns(const InsnClassScratch_t& classes)
+{
+	return none_of(ALLOF(classes), [](const InsnClass_t& ic)
+		{
+			return ic.kind==ExitKind_t::Return || ic.kind==ExitKind_t::TailJump || ic.kind==ExitKind_t::IBExit;
+		});
+}
 
-			// if it definitely leaves or stay, go ahead and instrument.
-			if(definitely_leaves || definitely_stays)
-			{
-				// empty 
-			}
-			else if (might_leave || might_stay)
-			{
-				// otherwise, it might leave and might stay, so we skip instrumentation.
+// 
+// A method to check whether a stampable function is a leaf that can't overwrite its return address, 
+// so stamping it would only cost time.  It must not call or jump to another function (which might 
+// write the slot for it), and no instruction may write the slot (see may_write_frame).
+//
+// Lastly, a pop with nothing pushed would take the return address off the stack (and a push after it 
+// would write the slot), so walk the function from its entry and check that every path keeps the 
+// pushes and pops balanced.  The walk's bookkeeping is scratch, in the calling thread's arena.
+// 
+bool StackStamp_t::is_safe_leaf(Function_t* f, const InsnClassScratch_t& classes, bool frame_writes, AnalysisScratch_t& scratch)
+{
+	if(!m_elide_safe_leaves || frame_writes)
+		return false;
+
+	const auto is_leaf=all_of(ALLOF(classes), [](const InsnClass_t& ic)
+		{
+			return ic.kind==ExitKind_t::NotAnExit || ic.kind==ExitKind_t::Return || ic.kind==ExitKind_t::IBStay;
+		});
+	if(!is_leaf)
+		return false;
+
+	// the stack depth (pushes less pops) before each instruction reached so far
+	using DepthAllocator_t = ArenaAllocator_t<pair<Instruction_t* const, int> >;
+	auto depth_at=unordered_map<Instruction_t*, int, hash<Instruction_t*>, equal_to<Instruction_t*>, DepthAllocator_t>(
+		classes.size(), hash<Instruction_t*>(), equal_to<Instruction_t*>(), DepthAllocator_t(scratch.arena));
+	auto work=ArenaVector_t<pair<Instruction_t*, int> >(ArenaAllocator_t<pair<Instruction_t*, int> >(scratch.arena));
+	work.push_back({f->getEntryPoint(), 0});
+	while(!work.empty())
+	{
+		const auto insn=work.back().first;
+		const auto depth=work.back().second;
+		work.pop_back();
+
+		// paths that meet must agree on the depth.
+		const auto seen=depth_at.find(insn);
+		if(seen!=depth_at.end())
+		{
+			if(seen->second!=depth)
 				return false;
-			}
-			else
-				// this would assert that I wrote the above logic correctly.
-				assert(0);
+			continue;
+		}
+		depth_at[insn]=depth;
+
+		const auto &di=decode(insn, scratch);
+		const auto next_depth=depth + di.stack_delta;
+		if(next_depth<0)
+			return false;
+
+		// a return with something still pushed returns to that something.
+		if(di.is_return)
+		{
+			if(depth!=0)
+				return false;
+			continue;
+		}
+
+		// and on to the successors, which are all in this function (it's a leaf).
+		if(insn->getFallthrough())
+			work.push_back({insn->getFallthrough(), next_depth});
+		if(insn->getTarget())
+			work.push_back({insn->getTarget(), next_depth});
+		if(insn->getIBTargets())
+			for(const auto target : *insn->getIBTargets())
+				work.push_back({target, next_depth});
+	}
+
+	return true;
+}
+
+// 
+// Find the fixed calls (see classify), which are marked with a "fix_call_fallthrough" relocation, in one 
+// pass over the IR.  Few instructions have any relocations, so this is much cheaper than searching each 
+// instruction's relocations by name as it's classified.
+//
+void StackStamp_t::index_fixed_calls()
+{
+	const auto fix_call_fallthrough_string=string("fix_call_fallthrough");
+	for(const auto insn : getFileIR()->getInstructions())
+	{
+		const auto &relocs=insn->getRelocations();
+		const auto is_fixed_call=any_of(ALLOF(relocs), [&](const Relocation_t* reloc) { return reloc->getType()==fix_call_fallthrough_string; });
+		if(is_fixed_call)
+			m_fixed_calls.insert(insn);
+	}
+}
+
+// 
+// Summarize where an ICFS's targets are, so that classify_ib can tell if an IB leaves its function 
+// without scanning the targets.  ICFS sets can be large (e.g., switch tables) and shared by many 
+// IBs (e.g., PLT-like dispatch), so it's much cheaper to scan each set once.
+//
+StackStamp_t::IcfsSummary_t StackStamp_t::summarize_icfs(const ICFS_t* icfs)
+{
+	auto summary=IcfsSummary_t();
+	if(icfs->empty())
+		return summary;
+
+	summary.only_function=(*icfs->begin())->getFunction();
+	const auto one_function=all_of(ALLOF(*icfs), [&](const Instruction_t* target) { return target->getFunction()==summary.only_function; });
+	if(one_function)
+		return summary;
+
+	// the targets are in several functions (or none), so keep the set of them.
+	summary.only_function=nullptr;
+	summary.functions.reserve(icfs->size());
+	for(const auto target : *icfs)
+		summary.functions.push_back(target->getFunction());
+	sort(ALLOF(summary.functions));
+	summary.functions.erase(unique(ALLOF(summary.functions)), summary.functions.end());
+	summary.functions.shrink_to_fit();
+	return summary;
+}
+
+// 
+// Summarize every ICFS in the IR, before the analysis threads start (so they can share the summaries 
+// without locking).
+//
+void StackStamp_t::summarize_all_icfs()
+{
+	const auto &all_icfs=getFileIR()->getAllICFS();
+	m_icfs_summaries.reserve(all_icfs.size());
+	for(const auto icfs : all_icfs)
+		m_icfs_summaries[icfs]=summarize_icfs(icfs);
+}
+
+// 
+// Whether an IB with the given targets definitely leaves f, definitely stays in f, or might do either.
+//
+ExitKind_t StackStamp_t::classify_ib(const ICFS_t* icfs, const Function_t* f) const
+{
+	const auto verdict=[&](const IcfsSummary_t& summary)
+		{
+			// all the targets are in one function:  it's this one, or the IB leaves.
+			if(summary.functions.empty())
+				return summary.only_function==f ? ExitKind_t::IBStay : ExitKind_t::IBExit;
+
+			// otherwise, some targets are elsewhere.  If any are here, the IB might leave and might stay.
+			return binary_search(ALLOF(summary.functions), f) ? ExitKind_t::IBMixed : ExitKind_t::IBExit;
+		};
+
+	// ICFS sets should all be in the IR, but if not, summarize it here.
+	const auto it=m_icfs_summaries.find(icfs);
+	return it!=m_icfs_summaries.end() ? verdict(it->second) : verdict(summarize_icfs(icfs));
+}
+
+// 
+// A method to check whether a function is stampable. 
+// This method does no logging, so it can be used from analysis threads. If a conditional 
+// branch exit prevents stamping, it is returned in cond_exit so the caller can log it.
+// 
+bool StackStamp_t::can_stamp(Function_t* f, const InsnClassScratch_t& classes, Instruction_t* &cond_exit)
+{
+	// skip any functions with an entry 
+	if(f->getEntryPoint()==NULL) return false;
+
+	// _start does not have a return address on the stack.
+	if(f->getName() == "_start") return false;
+
+	// skip functions that might be a plt stub or are so simple they don't count  
+	if(f->getInstructions().size()<=3)  return false; 
+
+	// check to see if there are odd instructions in this function that we don't want to stamp 
+	for(const auto &ic : classes)
+	{
+		switch(ic.kind)
+		{
+			case ExitKind_t::CondTailJump:
+				// generally tails calls are OK, but
+				// conditional tail calls?  I just don't want 
+				// figuring out how to instrument them.
+				// let the caller log this anomaly.
+				cond_exit=ic.insn;
+				return false;
+
+			case ExitKind_t::IBMixed:
+				// like a conditional branch that might leave and might stay,
+				// I don't want to instrument IBs that might leave and might stay.
+				return false;
+
+			default:
+				// returns, calls (fixed or otherwise), tail jumps, and IBs that 
+				// definitely leave or definitely stay are all OK.
+				break;
 		}
 	};
 
@@ -187,50 +601,476 @@ bool StackStamp_t::can_stamp(Function_t* f)
 }
 
 // 
-// How to stamp an individual instruction.
+// Analyze a function:  classify its instructions, check if it can be stamped, and if so plan the edits.
+// Nothing is modified (or logged) here.  scratch is private to the calling thread:  its memos last for 
+// the whole analysis, and its arena is for this function only.
+// 
+StackStamp_t::FunctionAnalysis_t StackStamp_t::analyze(Function_t* f, AnalysisScratch_t& scratch)
+{
+	// the previous function's scratch is all gone by now.
+	scratch.arena.reset();
+
+	auto fa=FunctionAnalysis_t();
+	auto frame_writes=true;
+	const auto classes=classify(f, frame_writes, scratch);
+	fa.stampable=can_stamp(f,classes,fa.cond_exit);
+	fa.never_returns=fa.stampable && never_returns(classes);
+	fa.safe_leaf=fa.stampable && !fa.never_returns && is_safe_leaf(f, classes, frame_writes, scratch);
+	if(fa.stampable && !fa.never_returns && !fa.safe_leaf)
+	{
+		plan_stamps(f, classes, fa);
+
+		// only stamps change the EH info, counters do not.  A rule in the CIE is added after stamping, 
+		// so needs no plan (see finish_cie_stamp_rules).
+		if(m_count_mode!=CountMode_t::Instead && !m_cie_stamp_rule)
+			plan_eh_update(f, fa, scratch.placeholders);
+	}
+	return fa;
+}
+
+// 
+// Plan how to stamp a function:  which instructions get stamped, and which jumps to the entry
+// should skip the entry's stamp.
+// 
+void StackStamp_t::plan_stamps(Function_t* f, const InsnClassScratch_t& classes, FunctionAnalysis_t& fa)
+{
+	const auto entry=f->getEntryPoint();
+	for(const auto &ic :  classes)
+	{
+		switch(ic.kind)
+		{
+			// stamp all returns
+			case ExitKind_t::Return:
+			// if it has a target that exits the function, it's likely a tail call (as a jmp insn)
+			// Conditional jumps that leave the function are detected in can_stamp as not stampable.
+			case ExitKind_t::TailJump:
+			// jump with IB targets are likely switches.
+			// stamp if we definitely are leaving this function.
+			// 	this is probably a tail jump that leaves the func, or a plt entry
+			// IBs that might leave and might stay were rejected by can_stamp.
+			case ExitKind_t::IBExit:
+				fa.sites.push_back(ic);
+				break;
+
+			// an indirect jump at a function entry needs a stamp	
+			case ExitKind_t::IBStay:
+				if(ic.insn==entry)
+					fa.sites.push_back(ic);
+				break;
+
+			// do not stamp on calls (fixed or otherwise), or anything else
+			default:
+				break;
+		}
+	};
+
+	// Look for any instructions in the function that reference the entry point.
+	// Case 1: Those instructions might be recursive calls.  
+	// Case 2: The prologue of the function may be empty and the start of a loop.  
+	// Try to distinguish between these cases and decide which instructions should
+	// jump to the xor and which ones should skip it.
+	// Calls should jump to the xor, as should any instruction that we stamp (the stamp takes its place).
+	const auto is_site=[&](const Instruction_t* insn)
+		{
+			return insn==entry || find_if(ALLOF(fa.sites), [&](const InsnClass_t& site) { return site.insn==insn; }) != fa.sites.end();
+		};
+	for(const auto &ic :  classes)
+	{
+		if(ic.insn->getTarget()==entry && ic.kind!=ExitKind_t::Call && !is_site(ic.insn))
+			fa.retargets.push_back(ic.insn);
+	};
+}
+
+// 
+// Plan the EH updates for a function by building the stamped placeholder for each EH program it uses.
+// This is the expensive part of updating the EH info (copying programs, and hashing the result), so
+// it's done here in the analysis phase.  Each thread has a memo of placeholders, so a thread builds 
+// a placeholder for any given EH program only once.
+// 
+void StackStamp_t::plan_eh_update(Function_t* f, FunctionAnalysis_t& fa, PlaceholderMemo_t& placeholders)
+{
+	const auto sv=get_stamp(f);
+
+	for(auto insn : f->getInstructions()) 
+	{
+		const auto eh_pgm=insn->getEhProgram();
+		if(eh_pgm==NULL) continue;
+
+		// already planned for this function?
+		if(fa.eh_placeholders.find(eh_pgm)!=fa.eh_placeholders.end()) continue;
+
+		// find or build the placeholder 
+		auto &placeholder=placeholders[EhProgramMemoKey_t(eh_pgm, sv)];
+		if(!placeholder)
+			placeholder=make_stamped_placeholder(eh_pgm, sv);
+
+		fa.eh_placeholders[eh_pgm]=placeholder;
+	};
+}
+
+// 
+// Analyze the functions funcs[first..last), in parallel if we're allowed more than one job.
+// The results go in the same slots of analyses, so the stamping phase can apply them 
+// in the deterministic order regardless of which thread did the work.
+//
+// Functions outside the selection (if any) are not analyzed, just marked.  funcs must be in the 
+// sorted order, as the selection's indices refer to it.
+// 
+void StackStamp_t::analyze_all(const vector<Function_t*>& funcs, size_t first, size_t last, FunctionAnalysisList_t& analyses)
+{
+	assert(first<=last && last<=funcs.size() && analyses.size()==funcs.size());
+	m_functions_examined += last-first;
+	const auto analyze_one=[&](size_t i, AnalysisScratch_t& scratch)
+		{
+			if(m_selection && !m_selection->selects(funcs[i], i))
+				analyses[i].in_selection=false;
+			else
+				analyses[i]=analyze(funcs[i], scratch);
+		};
+
+	// no need for threads if we're doing one job at a time.
+	if(m_jobs<=1 || last-first<=1)
+	{
+		AnalysisScratch_t scratch; // AnalysisScratch_t has no copy constructor, cannot use auto style decls.
+		for(auto i=first; i<last; i++)
+			analyze_one(i, scratch);
+		add_scratch_stats(scratch);
+		return;
+	}
+
+	// 
+	// The workers decode concurrently:  decode calls DecodedInstruction_t::factory for each memo miss, 
+	// with no lock.  That relies on the decoder being safe to call from several threads once it is set 
+	// up, i.e., each call builds its own decoded instruction and only reads the IR instruction it's given.  
+	// What isn't safe is the setup itself, which the decoder may do lazily on first use, so do one decode 
+	// here before there are threads that might race to do it.  (If a decoder ever keeps shared state 
+	// between calls, decodes must be serialized, or the analysis run with one job.)
+	//
+	const auto first_insn=find_if(funcs.begin()+first, funcs.begin()+last, [](const Function_t* f) { return !f->getInstructions().empty(); });
+	if(first_insn!=funcs.begin()+last)
+		(void)DecodedInstruction_t::factory(*(*first_insn)->getInstructions().begin());
+
+	// 
+	// Each thread grabs the next un-analyzed function until there are none left, and writes the analysis 
+	// (including the edit plan) into that function's slot.  The slots are applied in order later, which 
+	// merges the threads' work back into the deterministic order.
+	//
+	// An exception must not escape a thread (that terminates the process), so each worker catches 
+	// what it throws, and stops the others.  The first one is rethrown here once they're all done.
+	//
+	atomic<size_t> next(first); // atomics have no copy constructor, cannot use auto style decls.
+	const auto thread_count=min(m_jobs,last-first);
+	auto scratches=vector<unique_ptr<AnalysisScratch_t> >();
+	auto errors=vector<exception_ptr>(thread_count);
+	const auto worker=[&](AnalysisScratch_t* scratch, exception_ptr* error)
+		{
+			try
+			{
+				while(true)
+				{
+					const auto i=next++;
+					if(i>=last) 
+						break;
+					analyze_one(i, *scratch);
+				}
+			}
+			catch(...)
+			{
+				*error=current_exception();
+				next=last;
+			}
+		};
+
+	// start the workers and wait for them.  The decoder was primed above.
+	auto workers=vector<thread>();
+	for(auto i=size_t(0); i<thread_count; i++)
+	{
+		scratches.push_back(unique_ptr<AnalysisScratch_t>(new AnalysisScratch_t()));
+		workers.push_back(thread(worker, scratches.back().get(), &errors[i]));
+	}
+	for(auto &t : workers)
+		t.join();
+	for(const auto &error : errors)
+	{
+		if(error)
+			rethrow_exception(error);
+	};
+	for(const auto &scratch : scratches)
+		add_scratch_stats(*scratch);
+}
+
+// 
+// Add up the stats of a thread's scratch, once the thread is done with it.
+// 
+void StackStamp_t::add_scratch_stats(const AnalysisScratch_t& scratch)
+{
+	m_decodes            += scratch.decodes_done;
+	m_decode_memo_hits   += scratch.decode_hits;
+	m_scratch_bytes      += scratch.arena.bytesServed();
+	m_arena_allocations  += scratch.arena.allocations();
+	m_arena_blocks       += scratch.arena.heapBlocks();
+}
+
+// 
+// Use the profile to choose which stampable functions to stamp.  Functions that aren't chosen are 
+// marked as not selected in their analysis.
+//
+// The cost model:  a stamped function executes two extra instructions per call (the stamp at the entry 
+// and the one at whichever exit is taken).  The profile tells us what fraction of the run time each 
+// function takes, and we assume that time is spread over calls of about the function's size.  So 
+// stamping f costs about (f's share of samples) * 2 / (f's instruction count) of the run time.  This 
+// is crude, but it ranks tiny hot helpers as the most expensive, which is what matters.
+//
+// The policy (see ProfilePolicy_t) first drops the most-sampled functions, then stamps the rest 
+// cheapest first, until the budget is spent or the minimum coverage is reached, whichever comes later.
+//
+void StackStamp_t::select_functions(const vector<Function_t*>& funcs, FunctionAnalysisList_t& analyses)
+{
+	assert(m_profile);
+	m_profile_samples=m_profile->byFunction(getFileIR(), m_profile_unmapped);
+
+	const auto total=max<uint64_t>(m_profile->totalSamples(), 1);
+	const auto samples_of=[&](size_t i) -> uint64_t
+		{
+			const auto it=m_profile_samples.find(funcs[i]);
+			return it==m_profile_samples.end() ? 0 : it->second;
+		};
+	const auto cost_of=[&](size_t i) -> double
+		{
+			return 100.0 * samples_of(i) / total * 2.0 / max<size_t>(funcs[i]->getInstructions().size(), 1);
+		};
+	const auto deselect=[&](size_t i)
+		{
+			analyses[i].selected=false;
+			m_functions_profile_skipped++;
+		};
+
+	// the candidates are the stampable functions (that need it), in the sorted (deterministic) order
+	auto candidates=vector<size_t>();
+	for(auto i=size_t(0); i<funcs.size(); i++)
+		if(analyses[i].stampable && !analyses[i].never_returns && !analyses[i].safe_leaf)
+			candidates.push_back(i);
+
+	// drop the hottest
+	const auto skip=min(m_profile_policy.skip_hottest, candidates.size());
+	stable_sort(ALLOF(candidates), [&](size_t a, size_t b) { return samples_of(a) > samples_of(b); });
+	for_each(candidates.begin(), candidates.begin()+skip, deselect);
+	candidates.erase(candidates.begin(), candidates.begin()+skip);
+
+	// and stamp the rest cheapest first
+	const auto min_selected=(size_t)ceil(m_profile_policy.min_coverage_pct / 100.0 * funcs.size());
+	const auto budget=m_profile_policy.overhead_budget_pct;
+	auto selected=size_t(0);
+	stable_sort(ALLOF(candidates), [&](size_t a, size_t b) { return cost_of(a) < cost_of(b); });
+	for(const auto i : candidates)
+	{
+		const auto cost=cost_of(i);
+		const auto below_min = selected < min_selected;
+		const auto in_budget = budget < 0 || m_profile_predicted_overhead+cost <= budget;
+		if(!below_min && !in_budget)
+		{
+			deselect(i);
+			continue;
+		}
+		selected++;
+		m_profile_predicted_overhead+=cost;
+		m_profile_selected_samples+=samples_of(i);
+	}
+
+	m_profile_predicted_coverage = funcs.empty() ? 0.0 : 100.0 * selected / funcs.size();
+}
+
+// 
+// Report how the profile was used, alongside the functions transformed stats.
+//
+void StackStamp_t::report_profile()
+{
+	const auto total=max<uint64_t>(m_profile->totalSamples(), 1);
+	const auto all_funcs=max(m_functions_transformed+m_functions_not_transformed, 1);
+	const auto pct_achieved=100.0 * m_functions_transformed / all_funcs;
+
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Samples="                   << dec << m_profile->totalSamples()  << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Unmapped_Samples="          << dec << m_profile_unmapped         << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Functions_Skipped="         << dec << m_functions_profile_skipped << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Predicted_Coverage="        << fixed << setprecision(1) << m_profile_predicted_coverage << "%" << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Achieved_Coverage="         << fixed << setprecision(1) << pct_achieved                 << "%" << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Predicted_Sample_Coverage=" << fixed << setprecision(1) << 100.0*m_profile_selected_samples/total << "%" << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Achieved_Sample_Coverage="  << fixed << setprecision(1) << 100.0*m_profile_stamped_samples/total  << "%" << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Profile_Predicted_Overhead="        << fixed << setprecision(3) << m_profile_predicted_overhead << "%" << endl;
+}
+
+// 
+// How to encode the stamp instruction, that is:
+//
+// 	xor dword [rsp], stamp_value  (or esp for 32-bit)
+//
+// The bytes depend only on the architecture and the stamp value, so we encode them once for each pair
+// instead of formatting and assembling the instruction at every stamp site.
+// 
+// The encoding is the same for 32- and 64-bit x86:  opcode 0x81 (or 0x83 if the value fits in a sign-extended 
+// byte) with ModRM 0x34 (/6, i.e., xor, with a SIB byte) and SIB 0x24 (base=esp/rsp, no index), then the immediate.
 // 
-Instruction_t* StackStamp_t::stamp(Function_t* f, Instruction_t* i)
+const string& StackStamp_t::stamp_encoding(StampValue_t sv)
 {
-	assert(f && i);
+	const auto key=make_pair(getFileIR()->getArchitectureBitWidth(), sv);
+	auto &bits=stamp_encodings[key];
+	if(!bits.empty()) 
+		return bits;
+
+	// sanity: we only know how to encode for x86
+	assert(key.first==32 || key.first==64);
 
-	stringstream assembly; // stringstream has no copy constructor, cannot use auto style decls.
-	const auto spreg= getFileIR()->getArchitectureBitWidth()==64 ?  string("rsp") : string("esp");
+	const auto imm=(int32_t)sv;
+	if(imm >= -128 && imm <= 127)
+	{
+		bits=string({(char)0x83, (char)0x34, (char)0x24, (char)imm});
+	}
+	else
+	{
+		bits=string({(char)0x81, (char)0x34, (char)0x24});
+		for(auto byte=0; byte<4; byte++)
+			bits+=(char)((sv >> (byte*8)) & 0xff);
+	}
+	return bits;
+}
 
-	assembly << " xor dword [" << spreg << "], 0x" << hex << get_stamp(f);
+// 
+// How to stamp an individual instruction, given the encoded stamp instruction.  Used by instrument.
+// 
+Instruction_t* StackStamp_t::stamp(Function_t* f, Instruction_t* i, const string& bits)
+{
+	assert(f && i);
 
 	// 
-	// Note about insertAsmBefore:  the old ('after') instruction gets copied to a new Instruction_t, and then the 
-	// old Instruction_t gets overwritten with the new assembly as the 'before' instruction.
+	// Note about insertDataBitsBefore:  the old ('after') instruction gets copied to a new Instruction_t, and then the 
+	// old Instruction_t gets overwritten with the new bits as the 'before' instruction.
 	// 
 	// Thus, after the call:
 	//    1) variable 'i' represents 'before'.
-	//    2) return value from insertAssembly before represents 'after' 
+	//    2) return value from insertDataBitsBefore represents 'after' 
 	// 
 	// This can be counterintuitive, but the alternatives are worse.
-	// In this example, we do not need the pointer to the newly created instruction (which holds the old assembly),
-	// so we simply cast to void 
+	// We need the pointer to the newly created instruction (which holds the old instruction) to tell the 
+	// caller where the original went.
 	// 
-	(void)insertAssemblyBefore(i, assembly.str());
+	const auto after=insertDataBitsBefore(i, bits);
+	m_instructions_added++;
 
 	// logging
-	if (m_verbose)
+	if (m_log.enabled(LogLevel_t::Site))
 	{
-		cout << "\tAdding: " << assembly.str() << " before : " << hex<<i->getBaseID()<<":"<<i->getDisassembly() 
+		m_log.stream() << "\tAdding:  xor dword [" << m_sp_name << "], 0x" << hex << get_stamp(f) << " before : " << hex<<i->getBaseID()<<":"<<i->getDisassembly() 
 		     << "@0x"<<i->getAddress()->getVirtualOffset()<<endl;
 	}
 
-	// update stats
+	return after;
+}
+
+// 
+// How to count executions of an instruction:  insert 
+//
+// 	inc qword [rip+counter]
+//
+// before it.  The counter is a slot in the counter scoop (see make_counter_scoop), and a "pcrel" relocation 
+// with respect to the scoop tells the rewriter to fix up the displacement, which holds the slot's offset in 
+// the scoop until then.
+//
+// Like the stamp itself, the increment clobbers the flags.  Stamp sites are function entries and exits, 
+// where the ABI says the flags are dead.
+//
+Instruction_t* StackStamp_t::count(Function_t* f, Instruction_t* i)
+{
+	assert(f && i && m_counter_scoop);
+
+	// each site's slot is its original address followed by its count, after a 24 byte header.
+	const auto index=m_counter_sites.size();
+	const auto offset=(uint32_t)(24 + index*16 + 8);
+	m_counter_sites.push_back(i->getAddress()->getVirtualOffset());
+
+	auto bits=string({(char)0x48, (char)0xff, (char)0x05});  // REX.W, inc r/m64 (/0), rip-relative
+	for(auto byte=0; byte<4; byte++)
+		bits+=(char)((offset >> (byte*8)) & 0xff);
+
+	// as in stamp, i becomes the counter and after holds the original.
+	const auto after=insertDataBitsBefore(i, bits);
+	getFileIR()->addNewRelocation(i, 0, "pcrel", m_counter_scoop, 0);
 	m_instructions_added++;
 
-	return i;
+	SS_LOG(m_log, LogLevel_t::Site) << "\tAdding:  inc qword [rip+counter " << dec << index << "] in " << f->getName() << " before : " << hex << after->getBaseID() << ":" << after->getDisassembly() 
+	                                << "@0x" << m_counter_sites.back() << endl;
+
+	return after;
+}
+
+// 
+// Stamp and/or count a site, depending on the count mode.  Counting is done last, so the counter 
+// precedes the stamp.  Either way, the instruction that was at i ends up after the new instructions.
+//
+Instruction_t* StackStamp_t::instrument(Function_t* f, Instruction_t* i, const string& bits)
+{
+	auto original=i;
+	if(m_count_mode!=CountMode_t::Instead)
+		original=stamp(f, i, bits);
+	if(m_count_mode!=CountMode_t::None)
+	{
+		const auto after=count(f, i);
+		if(original==i)
+			original=after;
+	}
+	return original;
 }
 
 // 
-// How to update the exception handling (EH) info for a function after we have stamped it.
+// Create the data scoop that holds the counters.  Its size isn't known until all the sites are counted, 
+// see finish_counter_scoop.  It goes on a fresh page after all the other scoops, so that it doesn't 
+// overlap them and so that the dumper (see counters/ss_counters.c) can find it by checking page starts.
+//
+void StackStamp_t::make_counter_scoop()
+{
+	auto last=VirtualOffset_t(0);
+	for(const auto scoop : getFileIR()->getDataScoops())
+		last=max(last, scoop->getEnd()->getVirtualOffset());
+	const auto start=(last + 1 + 0xfff) & ~VirtualOffset_t(0xfff);
+
+	const auto file_id=getFileIR()->getFile()->getBaseID();
+	const auto start_addr=getFileIR()->addNewAddress(file_id, start);
+	const auto end_addr=getFileIR()->addNewAddress(file_id, start);
+	m_counter_scoop=getFileIR()->addNewDataScoop("stack_stamp_counters", start_addr, end_addr, nullptr, 6 /* rw- */, false, "");
+}
+
 // 
-void StackStamp_t::eh_update(Function_t* f)
+// Fill in the counter scoop:  
+//
+// 	char     magic[16];    // "SS_COUNTERS_V1"
+// 	uint64_t sites;        // how many sites
+// 	struct { uint64_t address, count; } site[sites];
+//
+// The counts start at zero.  The address is each site's address in the original program, so a dump of 
+// the counters is a profile that --profile can read.  As with stamp_rule, this assumes the host and target 
+// have the same endianness.
+//
+void StackStamp_t::finish_counter_scoop()
 {
+	assert(m_counter_scoop);
+	const auto u64=[](const uint64_t value) { return string(reinterpret_cast<const char*>(&value), sizeof(value)); };
+
+	auto contents=string("SS_COUNTERS_V1\0\0", 16);
+	contents+=u64(m_counter_sites.size());
+	for(const auto addr : m_counter_sites)
+		contents+=u64(addr)+u64(0);
+
+	m_counter_scoop->setContents(contents);
+	m_counter_scoop->getEnd()->setVirtualOffset(m_counter_scoop->getStart()->getVirtualOffset() + contents.size() - 1);
 
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::counted_sites=" << dec << m_counter_sites.size() << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::counter_scoop_address=0x" << hex << m_counter_scoop->getStart()->getVirtualOffset() << endl;
+}
+
+// 
+// How to build the DWARF instruction that describes a stamped return address.
+// 
+EhProgramInstruction_t StackStamp_t::stamp_rule(StampValue_t sv)
+{
 	// create a new EH program dwarf instruction, that is:
 	//	r16= (*(cfa-8)) ^ stamp_value 
 	//
@@ -249,7 +1089,7 @@ void StackStamp_t::eh_update(Function_t* f)
 	//
 	//	we build it up in multiple parts, the constant prefix, the push of the stamp value, and the constant suffix. 
 	//
-	const auto stamp_value=(uint64_t)(get_stamp(f));
+	const auto stamp_value=(uint64_t)(sv);
 	const auto dwarf_instruction_prefix=
 		getFileIR()->getArchitectureBitWidth()==64 
 			? 
@@ -279,17 +1119,90 @@ void StackStamp_t::eh_update(Function_t* f)
 	const auto dwarf_instruction_stamp_value=string(reinterpret_cast<const char*>(&stamp_value),byte_width);
 	const auto dwarf_addr_insn = ((string){ 0x03 /* DW_OP_addr */ })+dwarf_instruction_stamp_value; 
 	const auto dwarf_instruction_suffix=(string){ 0x27 /* DW_OP_xor */};
-	const auto dwarf_instruction=(EhProgramInstruction_t)(dwarf_instruction_prefix+dwarf_addr_insn+dwarf_instruction_suffix);
+	return (EhProgramInstruction_t)(dwarf_instruction_prefix+dwarf_addr_insn+dwarf_instruction_suffix);
+}
+
+// 
+// How to build the "placeholder" for the stamped version of an EH program.  
+// Safe to call from analysis threads, as nothing in the IR is modified.
+// 
+StackStamp_t::PlaceholderPtr_t StackStamp_t::make_stamped_placeholder(const EhProgram_t* eh_pgm, StampValue_t sv)
+{
+	// the rule for the transform's stamp value is built once, in the constructor.
+	const auto dwarf_instruction= sv==m_stamp_value ? m_stamp_rule : stamp_rule(sv);
+
+	// 
+	// Create a new EH program "placeholder". The placeholder is the "key" in the cache.
+	//
+	auto nep=make_shared<EhProgramPlaceHolder_t>(eh_pgm);
+
+	if(m_cie_stamp_rule)
+	{
+		// 
+		// We are using the same stamp value for every function, so the rule can go into the CIE program.
+		// The FDE programs are left untouched.  This copy is only needed for a program that unstamped 
+		// instructions also use, see finish_cie_stamp_rules.
+		//
+		// The rule is appended, as the CIE's initial instructions typically describe the return address 
+		// register and we need to override that description.
+		//
+		auto &cie_pgm=nep->getCIEProgram();
+		cie_pgm.push_back(dwarf_instruction);
+	}
+	else
+	{
+		// 
+		// Per-function stamp values, so insert the new instruction into the beginning of the FDE program. 
+		// This overrides anything the CIE program says about the return address.
+		//
+		auto &fde_pgm=nep->getFDEProgram();
+		fde_pgm.insert(fde_pgm.begin(), dwarf_instruction);
+	}
+
+	// we are done editing the placeholder, calculate its hash before using it as a key.
+	nep->computeHash();
+
+	return nep;
+}
+
+// 
+// How to update the exception handling (EH) info for a function we are stamping.  This is done before the 
+// stamps are inserted, as the copies made during insertion share the EH program of the original.
+// The placeholders were built during analysis, see plan_eh_update.
+// 
+void StackStamp_t::eh_update(Function_t* f, const FunctionAnalysis_t& fa)
+{
+	// 
+	// With the rule in the CIE, the programs are updated once all functions are stamped (see 
+	// finish_cie_stamp_rules).  For now, just note which programs this function's instructions use.
+	//
+	if(m_cie_stamp_rule)
+	{
+		for(auto insn : f->getInstructions()) 
+		{
+			const auto eh_pgm=insn->getEhProgram();
+			if(eh_pgm==NULL) continue;
+
+			auto &uses=m_cie_eh_uses[eh_pgm];
+			if(uses.functions.empty())
+				m_cie_eh_pgms.push_back(eh_pgm);
+			if(uses.functions.empty() || uses.functions.back()!=f)
+				uses.functions.push_back(f);
+		};
+		m_cie_functions.insert(f);
+		return;
+	}
 
 	// 
-	// Now add this dwarf unwind instruction to the beginning of the dwarf unwind 
+	// Now add the stamp's dwarf unwind instruction to the dwarf unwind 
 	// info for every machine instruction in the funtion. 
 	//
 	// We need to do this carefully because creating a new EhProgram for every instruction in a large 
 	// program would result in using _lots_ of memory.  Thus, it's necessary to be careful to share EH programs.
 	//
 	// The input program may end up sharing differently than the output program, so it's necessary to construct
-	// a "cache" of EHPrograms to determine how to re-use appropriately.  The cache is organized as a hashtable.
+	// a "cache" of EHPrograms to determine how to re-use appropriately.  The cache is organized as a hashtable,
+	// keyed by a hash that is calculated once per placeholder.
 	//
 	// The cache starts empty, and we add to do it every time we need a new program.  If we calculate that an 
 	// instruciton's new EH program has already been seen, we can re-use the EH program from the cache.
@@ -302,16 +1215,28 @@ void StackStamp_t::eh_update(Function_t* f)
 		if(eh_pgm==NULL) continue;
 
 		// 
-		// Create a new EH program "placeholder". The placeholder is the "key" in the cache.
+		// IRDB shares EH programs between instructions, so we have likely stamped this very program before.
+		// If so, re-use the result without consulting the placeholder.
 		//
-		auto nep=EhProgramPlaceHolder_t(eh_pgm);
-		auto &fde_pgm=nep.getFDEProgram();
+		const auto memo_key=EhProgramMemoKey_t(eh_pgm, get_stamp(f));
+		const auto memo_it=stamped_eh_pgms.find(memo_key);
+		if(memo_it!=stamped_eh_pgms.end())
+		{
+			insn->setEhProgram(memo_it->second);
+
+			// stats
+			m_eh_memo_hits++;
+			m_eh_bytes_saved += fa.eh_placeholders.at(eh_pgm)->bytes;
+			continue;
+		}
 
-		// Insert the new instructoin into the FDE program. 
-		// maybe it'd be better to insert into the CIE program since we are doing the same stamp value for every function?
-		// Eliding that for now, as we may want future extensibility.
+		// 
+		// Find the placeholder built during analysis.  The stamps are not inserted yet, 
+		// so every program has been planned.
 		//
-		fde_pgm.insert(fde_pgm.begin(), dwarf_instruction);
+		const auto planned_it=fa.eh_placeholders.find(eh_pgm);
+		assert(planned_it!=fa.eh_placeholders.end());
+		const auto &nep=*planned_it->second;
 
 		// now look for this key in our cache 
 		const auto reuse_it=all_eh_pgms.find(nep);
@@ -327,14 +1252,142 @@ void StackStamp_t::eh_update(Function_t* f)
 
 			// and finally record this new "value" into our cache/hashtable.
 			all_eh_pgms[nep]=tmp_pgm;
+
+			// and remember what the old program became.
+			stamped_eh_pgms[memo_key]=tmp_pgm;
+
+			// stats
+			m_eh_cache_misses++;
 		}
 		else 
 		{
 			// We found that we've already created this EH program. 
 			// So, just share it for this instruction.
 			insn->setEhProgram(reuse_it->second);
+
+			// and remember what the old program became.
+			stamped_eh_pgms[memo_key]=reuse_it->second;
+
+			// stats
+			m_eh_cache_hits++;
+			m_eh_bytes_saved += nep.bytes;
+		}
+	};
+}
+
+// 
+// Add the stamp rule to the CIE program of each EH program the stamped functions use.  A program that 
+// only stamped instructions use is updated in place, so no new program is made.  A program that other 
+// instructions also use (unstamped functions, or instructions in no function) is copied with the rule, 
+// and the stamped functions' instructions are moved to the copy.  Copies are shared via the cache,
+// as in eh_update.
+//
+void StackStamp_t::finish_cie_stamp_rules()
+{
+	// find the programs that instructions outside the stamped functions also use.
+	for(auto insn : getFileIR()->getInstructions())
+	{
+		const auto eh_pgm=insn->getEhProgram();
+		if(eh_pgm==NULL) continue;
+
+		const auto uses_it=m_cie_eh_uses.find(eh_pgm);
+		if(uses_it!=m_cie_eh_uses.end() && m_cie_functions.find(insn->getFunction())==m_cie_functions.end())
+			uses_it->second.shared=true;
+	};
+
+	auto copies=unordered_map<const EhProgram_t*, EhProgram_t*>();
+	auto copied_functions=vector<Function_t*>();
+	for(const auto eh_pgm : m_cie_eh_pgms)
+	{
+		// only stamped instructions use it?  Then update it in place.
+		const auto &uses=m_cie_eh_uses.at(eh_pgm);
+		if(!uses.shared)
+		{
+			eh_pgm->getCIEProgram().push_back(m_stamp_rule);
+			m_eh_pgms_updated_in_place++;
+			continue;
+		}
+
+		// otherwise, find or make a copy with the rule, for the functions that use it.
+		copied_functions.insert(copied_functions.end(), ALLOF(uses.functions));
+		const auto nep=make_stamped_placeholder(eh_pgm, m_stamp_value);
+		const auto reuse_it=all_eh_pgms.find(*nep);
+		if(reuse_it==all_eh_pgms.end())
+		{
+			const auto new_pgm=getFileIR()->addEhProgram(nullptr, nep->caf, nep->daf, nep->rr, nep->ptrsize, nep->cie_program, nep->fde_program);
+			new_pgm->setRelocations(nep->relocs);
+			all_eh_pgms[*nep]=new_pgm;
+			copies[eh_pgm]=new_pgm;
+			m_eh_cache_misses++;
+		}
+		else
+		{
+			copies[eh_pgm]=reuse_it->second;
+			m_eh_cache_hits++;
+			m_eh_bytes_saved += nep->bytes;
 		}
 	};
+
+	// move those functions' instructions (including the stamps) to the copies.  Visit each function once.
+	sort(ALLOF(copied_functions));
+	copied_functions.erase(unique(ALLOF(copied_functions)), copied_functions.end());
+	for(const auto f : copied_functions)
+	{
+		for(auto insn : f->getInstructions()) 
+		{
+			const auto copy_it=copies.find(insn->getEhProgram());
+			if(copy_it!=copies.end())
+				insn->setEhProgram(copy_it->second);
+		};
+	};
+}
+
+// 
+// Add the time since start to the given phase.  Phases may be entered many times (e.g., once per function), 
+// so the time accumulates.  This is all end_phase does, as it's called a few times per stamped function.
+//
+void StackStamp_t::end_phase(Phase_t phase, const Clock_t::time_point& start)
+{
+	m_phase_seconds[phase] += chrono::duration<double>(Clock_t::now()-start).count();
+}
+
+// 
+// Record the process's peak RSS so far as the peak for the given phases.  Called once as each phase
+// finishes for good, not per function.  The stamp, eh_update and retarget phases interleave, so they
+// finish together.
+//
+void StackStamp_t::sample_peak_rss(const initializer_list<Phase_t>& phases)
+{
+	auto usage=rusage();
+	if(getrusage(RUSAGE_SELF, &usage)!=0)
+		return;
+	for(const auto phase : phases)
+		m_phase_peak_rss_kb[phase]=usage.ru_maxrss;  // in kilobytes on Linux
+}
+
+// 
+// Report the timing, memory and EH program cache stats in the same form as our other stats.
+//
+void StackStamp_t::report_phases()
+{
+	const char* phase_names[phCount] = { "sort", "feasibility", "stamp", "eh_update", "retarget", "cleanup" };
+
+	for(auto phase=0; phase<phCount; phase++)
+	{
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::phase_" << phase_names[phase] << "_seconds="     << fixed << setprecision(3) << m_phase_seconds[phase]      << endl;
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::phase_" << phase_names[phase] << "_peak_rss_kb=" << dec                        << m_phase_peak_rss_kb[phase] << endl;
+	}
+
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::decodes="             << dec << m_decodes             << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::decode_memo_hits="    << dec << m_decode_memo_hits    << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::scratch_bytes="       << dec << m_scratch_bytes       << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::arena_allocations="   << dec << m_arena_allocations   << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::arena_blocks="        << dec << m_arena_blocks        << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::eh_memo_hits="     << dec << m_eh_memo_hits    << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::eh_cache_hits="    << dec << m_eh_cache_hits   << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::eh_cache_misses="  << dec << m_eh_cache_misses << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::eh_bytes_saved="   << dec << m_eh_bytes_saved  << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::eh_programs_updated_in_place=" << dec << m_eh_pgms_updated_in_place << endl;
 }
 
 // 
@@ -344,7 +1397,7 @@ void StackStamp_t::cleanup_eh_pgms()
 {
 	// grab a copy of the EH programs just to print the size.
 	const auto &old_eh_pgms=getFileIR()->getAllEhPrograms();
-	cout<<"# ATTRIBUTE Stack_Stamping::before_transform_exception_handler_programs="<<dec<<old_eh_pgms.size()<<endl;
+	SS_LOG(m_log, LogLevel_t::Summary)<<"# ATTRIBUTE Stack_Stamping::before_transform_exception_handler_programs="<<dec<<old_eh_pgms.size()<<endl;
 
 	// recalculate the new EH programs.
 	auto new_eh_pgms=EhProgramSet_t();
@@ -359,198 +1412,341 @@ void StackStamp_t::cleanup_eh_pgms()
 	// now record in the IR that this is the set of EH programs.
 	getFileIR()->setAllEhPrograms(new_eh_pgms);
 
-	cout<<"# ATTRIBUTE Stack_Stamping::after_transform_exception_handler_programs="<<dec<<all_eh_pgms.size()<<endl;
-	cout<<"# ATTRIBUTE Stack_Stamping::total_instructions="<<dec<<getFileIR()->getInstructions().size()<<endl;
+	SS_LOG(m_log, LogLevel_t::Summary)<<"# ATTRIBUTE Stack_Stamping::after_transform_exception_handler_programs="<<dec<<new_eh_pgms.size()<<endl;
+	SS_LOG(m_log, LogLevel_t::Summary)<<"# ATTRIBUTE Stack_Stamping::stamp_rule_location="<<(m_cie_stamp_rule ? "cie" : "fde")<<endl;
+	SS_LOG(m_log, LogLevel_t::Summary)<<"# ATTRIBUTE Stack_Stamping::total_instructions="<<dec<<getFileIR()->getInstructions().size()<<endl;
 }
 
 // 
 // How to stamp an individual function 
 //
-void StackStamp_t::stamp(Function_t* f)
+void StackStamp_t::stamp(Function_t* f, const FunctionAnalysis_t& fa)
 {
 	// preconditions: F is a function from the IR.
 	assert(f);
 
+	// check to see if we were asked to leave it alone
+	if(!fa.in_selection)
+	{
+		SS_LOG(m_log, LogLevel_t::Function)<<"Skipping (not selected) "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
+		m_functions_not_transformed++;
+		m_functions_not_selected++;
+		return;
+	}
+
 	// check to see if we can stamp the function 
-	if(!can_stamp(f))
+	if(!fa.stampable)
 	{
+		// log any anomaly found during analysis.
+		if(fa.cond_exit)
+		{
+			SS_LOG(m_log, LogLevel_t::Summary) << "Skipping instrumentation of " << f->getName() << " because of cond branch exit.  Insn is: " << fa.cond_exit->getDisassembly() << endl;
+		}
+
 		// No, record stats.
-		cout<<"Skipping "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
+		SS_LOG(m_log, LogLevel_t::Function)<<"Skipping "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
 		m_functions_not_transformed++;
 
 		// and exit.
 		return;
 	}
 
+	// check to see if the function provably doesn't need it
+	if(fa.never_returns)
+	{
+		SS_LOG(m_log, LogLevel_t::Function)<<"Skipping (never returns) "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
+		m_functions_not_transformed++;
+		m_functions_never_return++;
+		return;
+	}
+	if(fa.safe_leaf)
+	{
+		SS_LOG(m_log, LogLevel_t::Function)<<"Skipping (safe leaf) "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
+		m_functions_not_transformed++;
+		m_functions_safe_leaves++;
+		return;
+	}
+
+	// check to see if the profile says not to stamp it
+	if(!fa.selected)
+	{
+		SS_LOG(m_log, LogLevel_t::Function)<<"Skipping (profile) "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
+		m_functions_not_transformed++;
+		return;
+	}
+
 	// sanity check can_stamp 
 	assert(f->getEntryPoint());
 
 	// Yes, we can stamp.  Do log/stats.
-	cout<<"Doing "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
+	SS_LOG(m_log, LogLevel_t::Function)<<"Doing "<<dec<<m_functions_transformed<<": "<<f->getName()<<endl;
 	m_functions_transformed++;
+	if(m_profile)
+	{
+		const auto samples_it=m_profile_samples.find(f);
+		if(samples_it!=m_profile_samples.end())
+			m_profile_stamped_samples+=samples_it->second;
+	}
 
-	const auto fix_call_fallthrough_string=string("fix_call_fallthrough");
+	// 
+	// Apply the plan made during analysis.  Update the eh frame info first, so that the copies made when 
+	// inserting the stamps inherit the stamped EH programs.  Then apply the stamps in one batch.
+	// (If we're only counting, the EH info stays as it is.)
+	//
+	if(m_count_mode!=CountMode_t::Instead)
+	{
+		const auto eh_start=Clock_t::now();
+		eh_update(f, fa);
+		end_phase(phEhUpdate, eh_start);
+	}
+
+	apply_stamps(f, fa.sites, fa.retargets);
+}
 
-	// Try to stamp each instruction 
-	// Correctness note:  the insertAssembly family of functions modifies f->getInstructions().
-	// If you try to iterate a container while modifying it, C++ gets very unhappy unless you are careful.
-	// Thus, we iterate on a copy of the set.
-	const auto old_f_insns=f->getInstructions();
-	for(auto insn :  old_f_insns)
+// 
+// Apply all the stamps for a function in a single pass:  stamp each site, then the entry, then update the 
+// instructions that should skip the entry's stamp (see plan_stamps).
+//
+// Correctness note:  inserting instructions modifies f->getInstructions().
+// If you try to iterate a container while modifying it, C++ gets very unhappy unless you are careful.
+// Thus, we iterate on the plan, which holds the instructions as they were before stamping.  No copy of the 
+// function's instruction set is needed.
+//
+void StackStamp_t::apply_stamps(Function_t* f, const InsnClassList_t& sites, const vector<Instruction_t*>& retargets)
+{
+	const auto stamp_start=Clock_t::now();
+	const auto entry=f->getEntryPoint();
+	const auto &bits=stamp_encoding(get_stamp(f));
+	const auto returns_done=consolidate_returns(f, sites, bits);
+
+	for(const auto &site :  sites)
 	{
-		// get some fields of the instruction to work on, including decoding it.
-		const auto di=DecodedInstruction_t::factory(insn);
-		const auto target=insn->getTarget();
-		const auto reloc=findRelocation(insn,fix_call_fallthrough_string);
-		const auto icfs=insn->getIBTargets();
+		// the returns may already share stamps.
+		if(site.kind==ExitKind_t::Return && returns_done)
+			continue;
 
-		// stamp all returns
-		if(di->isReturn())
+		// direct tail jumps wait until we know if their target is stamped, see fuse_tail_jumps.
+		// (Counters count every site, so there's nothing to fuse when counting.)
+		if(site.kind==ExitKind_t::TailJump && m_count_mode==CountMode_t::None)
 		{
-			if(m_verbose) cout<<"Stamping return"<<endl;
-			stamp(f,insn);
-		}
-		// check for calls specially.
-		else if(di->isCall() || reloc!=NULL)
-		{
-			// do nothing
-			// do not stamp on calls (fixed or otherwise)
+			SS_LOG(m_log, LogLevel_t::Site) << "Deferring tail jump" << endl;
+			m_tail_jumps.push_back({site.insn, f});
+			continue;
 		}
-		// else if it has a target that exits the function, it's likely a tail call (as a jmp insn)
-		else if(target && target->getFunction() != f)
-		{
-			// Conditional jump that leaves the function -- detected in can_stamp as not stampable.
-			// not handled yet as we have to instrument oddly.
-			assert(!insn->getFallthrough());
 
-			if(m_verbose) cout<<"Stamping with target!=function"<<endl;
-			stamp(f,insn);
-		} 
-		else if(di->isUnconditionalBranch() && icfs)
+		if(m_log.enabled(LogLevel_t::Site))
 		{
-			// jump with IB targets are likely switches.
-			assert(!insn->getFallthrough());
-
-			// This is similar to the logic in can_stamp.  We should isolate into a function/method that
-			// avoids the code duplication.  For now, though....
-
-			// make sure there are targets
-			assert(icfs->size() != 0);
-
-			// find a target that leaves
-			auto leaver=find_if(ALLOF(*icfs), [&](Instruction_t* target){
-			                    return target->getFunction()!=f;
-			                    });
-
-			// find a target that stays
-			auto stayer=find_if(ALLOF(*icfs), [&](Instruction_t* target){
-			                    return target->getFunction()==f;
-			                    });
-			
-			// calculate booleans about if something might leave
-			bool might_leave=leaver!=icfs->end();
-			bool might_stay=stayer!=icfs->end();
-
-			// if it might not leave, it definitely stays.
-			bool definitely_leaves=!might_stay;
-
-			// an indirect jump at a function entry needs a stamp	
-			if(insn==f->getEntryPoint())
-			{
-				if(m_verbose) cout << "Stamping IB at entry of function" << endl; 
-				stamp(f,insn);
-			}
-			// stamp if we definitely are leaving this function.
-			// or if we're not sure we stay (aka, we might_leave) and we're not complete) 
-			// 	this is probably a tail jump that leaves the func, or a plt entry
-			else if(definitely_leaves || (might_leave && !icfs->isComplete()))
+			switch(site.kind)
 			{
-				if(m_verbose && definitely_leaves ) cout << "Stamping IB because definitely_leaves " << endl; 
-				else if(m_verbose) cout << "Stamping IB because might_leave && icfs->isComplete() " << endl; 
-			 	stamp(f,insn);
+				case ExitKind_t::Return:   m_log.stream() << "Stamping return" << endl;                       break;
+				case ExitKind_t::TailJump: m_log.stream() << "Stamping with target!=function" << endl;        break;
+				case ExitKind_t::IBExit:   m_log.stream() << "Stamping IB because definitely_leaves " << endl; break;
+				case ExitKind_t::IBStay:   m_log.stream() << "Stamping IB at entry of function" << endl;      break;
+				default:                                                                                      break;
 			}
 		}
+		instrument(f,site.insn,bits);
 	};
 
 	// do not forget to stamp the entry.
-	stamp(f,f->getEntryPoint());
+	const auto skip_stamp=instrument(f,entry,bits);
+	m_stamped_entries[f]=skip_stamp;
+	end_phase(phStamp, stamp_start);
 
-	// Look for any instructions in the function that reference the entry point.
-	// Case 1: Those instructions might be recursive calls.  
-	// Case 2: The prologue of the function may be empty and the start of a loop.  
-	// Try to distinguish between these cases and decide which instructions should
-	// jump to the xor and which ones should skip it.
-	for(auto insn :  old_f_insns)
+	// Update the instructions that should skip the entry's stamp (and counter, if any).
+	const auto retarget_start=Clock_t::now();
+	for(const auto insn :  retargets)
 	{
-		if(insn->getTarget()==f->getEntryPoint())
-		{
-			const auto di=DecodedInstruction_t::factory(insn);
-			// calls should skip it.
-			if(!di->isCall())
-			{
-				cout << "Updating instruction " << hex << insn->getBaseID() << ":" << insn->getDisassembly() << " to skip stamp." << endl;
-				insn->setTarget(f->getEntryPoint()->getFallthrough());
-			}
-		}
+		SS_LOG(m_log, LogLevel_t::Function) << "Updating instruction " << hex << insn->getBaseID() << ":" << insn->getDisassembly() << " to skip stamp." << endl;
+		insn->setTarget(skip_stamp);
 	};
-
-	// update the eh frame info.
-	eh_update(f);		
+	end_phase(phRetarget, retarget_start);
 }
 
 // 
-// How to stamp an entire IR
+// Sort the functions by name, without being confused by two funcs with the same name (those are 
+// sorted by pointer value).  This makes the order of xform deterministic, which is useful for debugging.
+//
+// The result is a vector, so a function's position in it is an index, and work can be split into 
+// contiguous ranges of it.  
+//
+// Rather than a set of functions (a node per function, and names fetched for every comparison), this sorts 
+// precomputed keys in place.  Each key holds the start of the name, zero padded, which orders names the 
+// same way their compare does whenever it differs.  So most comparisons never touch the names at all.
 // 
-bool StackStamp_t::execute()
+vector<Function_t*> StackStamp_t::sort_functions()
 {
-	// A sorter that sorts by names without being confused by two funcs with the same name.  
-	// This is useful for deterministic debugging.
-	struct nameSorter
+	struct SortKey_t
 	{
-		bool operator()( const Function_t* lhs, const Function_t* rhs ) const 
-		{
-			// 
-			// Use tie here so we sort by names first, but then by
-			// pointer value in the event of two functions with the same name
-			// 
-			return tie(lhs->getName(), lhs ) < tie(rhs->getName(), rhs);
-		}
+		char prefix[16];
+		const string* name;
+		Function_t* func;
 	};
 
-	// Determine how many functions to stamp.  This would be better done with 
-	// a command line option, but someone was lazy...
+	const auto &funcs=getFileIR()->getFunctions();
+	auto keys=vector<SortKey_t>(funcs.size());
+	auto k=keys.begin();
+	for(const auto f : funcs)
+	{
+		const auto &name=f->getName();
+		memset(k->prefix, 0, sizeof(k->prefix));
+		name.copy(k->prefix, sizeof(k->prefix));
+		k->name=&name;
+		k->func=f;
+		k++;
+	}
+
+	sort(ALLOF(keys), [](const SortKey_t& lhs, const SortKey_t& rhs)
+		{
+			auto cmp=memcmp(lhs.prefix, rhs.prefix, sizeof(lhs.prefix));
+			if(cmp==0)
+				cmp=lhs.name->compare(*rhs.name);
+			return cmp!=0 ? cmp<0 : less<Function_t*>()(lhs.func, rhs.func);
+		});
+
+	auto sorted=vector<Function_t*>();
+	sorted.reserve(keys.size());
+	for(const auto &key : keys)
+		sorted.push_back(key.func);
+	return sorted;
+}
+
+// 
+// How to stamp an entire IR
+// 
+bool StackStamp_t::execute()
+{
+	// Determine how many functions to stamp.  The selection's limit is the better way, but 
+	// SS_MAX_DO_TRANSFORM still works (and, as it always has, allows one more than it says).
 	const auto ss_max_do_transform = getenv("SS_MAX_DO_TRANSFORM");
+	auto max_functions = m_selection ? m_selection->maxFunctions() : numeric_limits<size_t>::max();
+	if(ss_max_do_transform)
+		max_functions = min(max_functions, (size_t)max(atoi(ss_max_do_transform)+1, 0));
 
 	// let's sort the functions so the order of xform is deterministic.
-	const auto sorted_funcs = set<Function_t*, nameSorter> (ALLOF(getFileIR()->getFunctions()));
+	const auto sort_start   = Clock_t::now();
+	const auto sorted_funcs = sort_functions();
+	end_phase(phSort, sort_start);
+	sample_peak_rss({phSort});
+	m_log.flush();
 
-	// try to stamp functions one at a time, in the sorted order
-	for(auto func :  sorted_funcs)
+	// 
+	// Phase 1:  analyze the functions.  This does not modify the IR, so can be done in parallel. 
+	// Then, if we have a profile, use it to choose which of the stampable functions to stamp.
+	//
+	// Phase 2 stops at the selection's last index, so functions past it are never analyzed.  And when 
+	// only a few functions are wanted (and there's no profile, which needs every analysis to choose), 
+	// they're analyzed in batches, as phase 2 gets to them (see next_batch_end).
+	//
+	const auto analysis_start=Clock_t::now();
+	const auto end_index = m_selection ? m_selection->endIndex(sorted_funcs) : sorted_funcs.size();
+	const auto batched   = !m_profile && max_functions < end_index;
+	const auto next_batch_end=[&](size_t first) -> size_t
+		{
+			// twice what's still wanted, as some of the batch may not be stampable (or selected)
+			const auto wanted=max_functions-min(max_functions, (size_t)m_functions_transformed);
+			return min(end_index, first+max(2*wanted, size_t(64)));
+		};
+	auto analyzed=batched ? next_batch_end(0) : end_index;
+	auto analyses=FunctionAnalysisList_t(sorted_funcs.size());
+	index_fixed_calls();
+	summarize_all_icfs();
+	analyze_all(sorted_funcs, 0, analyzed, analyses);
+	if(m_profile)
+		select_functions(sorted_funcs, analyses);
+	end_phase(phFeasibility, analysis_start);
+	sample_peak_rss({phFeasibility});
+	m_log.flush();
+
+	// the counters need somewhere to live
+	if(m_count_mode!=CountMode_t::None)
+		make_counter_scoop();
+
+	// 
+	// Phase 2:  try to stamp functions one at a time, in the sorted order.  Stop as soon as the 
+	// selection is exhausted:  past its last index, or once we've transformed all we want.
+	//
+	auto i=size_t(0);
+	for( ; i<end_index && (size_t)m_functions_transformed<max_functions; i++)
 	{
-		// check to see if we've transformed everything we want already.
-		if (ss_max_do_transform && m_functions_transformed > atoi(ss_max_do_transform))
+		// analyze the next batch, if we're batching and have used up this one
+		if(i==analyzed)
 		{
-			continue;
+			const auto batch_start=Clock_t::now();
+			analyzed=next_batch_end(i);
+			analyze_all(sorted_funcs, i, analyzed, analyses);
+			end_phase(phFeasibility, batch_start);
 		}
 
-		// otherwise, stamp the function.	
-		stamp(func);
+		// stamp the function.	
+		stamp(sorted_funcs[i], analyses[i]);
 	};
 
+	// the rest weren't selected, no need to look at them.
+	m_selection_stopped_at=i;
+	m_functions_not_selected    += sorted_funcs.size()-i;
+	m_functions_not_transformed += sorted_funcs.size()-i;
+
+	// now we know which functions were stamped
+	fuse_tail_jumps();
+
+	// and which EH programs need the rule in their CIE
+	if(m_cie_stamp_rule)
+	{
+		const auto eh_start=Clock_t::now();
+		finish_cie_stamp_rules();
+		end_phase(phEhUpdate, eh_start);
+	}
+
+	// and how many counters there are
+	if(m_count_mode!=CountMode_t::None)
+		finish_counter_scoop();
+	sample_peak_rss({phStamp, phEhUpdate, phRetarget});
+
+	// stamping is done, write out what it logged.
+	m_log.flush();
+
 	// do cleanup on the EH programs after we've likely made many of them useless.
+	const auto cleanup_start=Clock_t::now();
 	cleanup_eh_pgms();
+	end_phase(phCleanup, cleanup_start);
+	sample_peak_rss({phCleanup});
+	m_log.flush();
 
 	// calculate and output stats 
+	if(m_consolidate_returns>0)
+	{
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::functions_with_consolidated_returns=" << dec << m_functions_returns_consolidated << endl;
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::returns_consolidated="                 << dec << m_returns_consolidated           << endl;
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::return_bytes_saved="                   << dec << m_return_bytes_saved             << endl;
+	}
 	const auto pct_transformed=((double)m_functions_transformed/(double)((m_functions_transformed+m_functions_not_transformed)))*100.00;
 	const auto pct_not_transformed=((double)m_functions_not_transformed/(double)(m_functions_transformed+m_functions_not_transformed))*100.00;
 
-	cout << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Instructions_added="        << dec << m_instructions_added                                << endl;
-	cout << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Total_number_of_functions=" << dec << m_functions_transformed+m_functions_not_transformed << endl;
-	cout << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Functions_Transformed="     << dec << m_functions_transformed                             << endl;
-	cout << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Functions_Not_Transformed=" << dec << m_functions_not_transformed                         << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Instructions_added="        << dec << m_instructions_added                                << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Total_number_of_functions=" << dec << m_functions_transformed+m_functions_not_transformed << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Functions_Transformed="     << dec << m_functions_transformed                             << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Functions_Not_Transformed=" << dec << m_functions_not_transformed                         << endl;
+
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Percent_Functions_Transformed="     << fixed << setprecision(1) <<  pct_transformed      << "%" << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Percent_Functions_Not_Transformed=" << fixed << setprecision(1) <<  pct_not_transformed  << "%" << endl;
+	SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Functions_Never_Return_Skipped=" << dec << m_functions_never_return << endl;
+	if(m_elide_safe_leaves)
+	{
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Functions_Safe_Leaves_Skipped=" << dec << m_functions_safe_leaves << endl;
+	}
+	if(m_selection || ss_max_do_transform)
+	{
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Functions_Not_Selected=" << dec << m_functions_not_selected << endl;
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::selection_stopped_at="           << dec << m_selection_stopped_at   << endl;
+		SS_LOG(m_log, LogLevel_t::Summary) << "# ATTRIBUTE Stack_Stamping::functions_examined="             << dec << m_functions_examined     << endl;
+	}
+	if(m_profile)
+		report_profile();
 
-	cout << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Percent_Functions_Transformed="     << fixed << setprecision(1) <<  pct_transformed      << "%" << endl;
-	cout << "# ATTRIBUTE ASSURANCE_Stack_Stamping::Percent_Functions_Not_Transformed=" << fixed << setprecision(1) <<  pct_not_transformed  << "%" << endl;
+	// and where the time went
+	report_phases();
+	m_log.flush();
 
 	// used in testing harness to verify that the stats are correct.
 	assert(getenv("SELF_VALIDATE")==nullptr || m_instructions_added    > 10);
@@ -562,11 +1758,55 @@ bool StackStamp_t::execute()
 
 // 
 // How to compare our EH program placeholders.  
-// Would this be better done with an explicitly named sorter?
-// Possibly it would be more clear what our intent is, but c'est la vie.
+// The precomputed hashes are compared first, so that a mismatch is (almost always) found 
+// without comparing the DWARF programs.
+// 
+bool Stamper::operator==(const StackStamp_t::EhProgramPlaceHolder_t &a, const StackStamp_t::EhProgramPlaceHolder_t& b)
+{
+	return tie( a.hash, a.caf, a.daf, a.rr, a.ptrsize, a.cie_program, a.fde_program, a.relocs ) ==
+	       tie( b.hash, b.caf, b.daf, b.rr, b.ptrsize, b.cie_program, b.fde_program, b.relocs ) ;
+}
+
 // 
-bool Stamper::operator<(const StackStamp_t::EhProgramPlaceHolder_t &a, const StackStamp_t::EhProgramPlaceHolder_t& b)
+// How to hash an EH program placeholder.  This is a 64-bit FNV-1a hash over every field that 
+// operator== compares.  Lengths are mixed in so that, e.g., {"ab","c"} and {"a","bc"} hash differently.
+// While we're visiting every byte of the programs, also record their size for the stats.
+// 
+void StackStamp_t::EhProgramPlaceHolder_t::computeHash()
 {
-	return tie( a.caf, a.daf, a.rr, a.ptrsize, a.cie_program, a.fde_program, a.relocs ) <
-	       tie( b.caf, b.daf, b.rr, b.ptrsize, b.cie_program, b.fde_program, b.relocs ) ;
+	auto h=(uint64_t)0xcbf29ce484222325ULL;  // FNV offset basis
+	const auto mix_byte=[&](const uint8_t b)
+		{
+			h ^= b;
+			h *= 0x100000001b3ULL;           // FNV prime
+		};
+	const auto mix_value=[&](const uint64_t v)
+		{
+			for(auto i=0u; i<sizeof(v); i++)
+				mix_byte((uint8_t)(v >> (i*8)));
+		};
+	const auto mix_listing=[&](const EhProgramListing_t& listing)
+		{
+			mix_value(listing.size());
+			for(const auto &insn : listing)
+			{
+				bytes += insn.size();
+				mix_value(insn.size());
+				for(const auto c : insn)
+					mix_byte((uint8_t)c);
+			}
+		};
+
+	bytes=0;
+	mix_value(caf);
+	mix_value((uint8_t)daf);
+	mix_value((uint8_t)rr);
+	mix_value(ptrsize);
+	mix_listing(cie_program);
+	mix_listing(fde_program);
+	mix_value(relocs.size());
+	for(const auto reloc : relocs)
+		mix_value((uint64_t)(uintptr_t)reloc);
+
+	hash=h;
 }
@@ -20,6 +20,14 @@
 #include <irdb-core>
 #include <irdb-transform>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <initializer_list>
+#include "ss_log.hpp"
+#include "ss_profile.hpp"
+#include "ss_selection.hpp"
+#include "ss_arena.hpp"
 
 // 
 // using a namespace for code readability
@@ -33,39 +41,213 @@ namespace Stamper
 	// a type for the stame values
 	using StampValue_t = unsigned int;
 
+	// 
+	// Whether to count executions of each stamp site, see StackStamp_t::count.
+	//
+	enum class CountMode_t
+	{
+		None,           // just stamp (the default)
+		WithStamps,     // stamp, and count each stamp site
+		Instead         // count each would-be stamp site, but don't stamp
+	};
+
+	// 
+	// How an instruction may leave (or not leave) its function.  Calculated once per instruction 
+	// so that checking and stamping a function need only decode each instruction one time.
+	//
+	enum class ExitKind_t
+	{
+		NotAnExit,      // stays in the function, nothing to do
+		Return,         // a return instruction
+		Call,           // a call instruction
+		FixedCall,      // a push/jmp pair standing in for a call (see can_stamp)
+		TailJump,       // a direct jump that leaves the function
+		CondTailJump,   // a conditional jump that leaves the function
+		IBExit,         // an indirect branch that definitely leaves
+		IBStay,         // an indirect branch that definitely stays
+		IBMixed         // an indirect branch that might leave and might stay
+	};
+
+	// 
+	// An instruction and how it exits its function.
+	//
+	struct InsnClass_t
+	{
+		Instruction_t* insn;    // the instruction
+		ExitKind_t     kind;    // how it exits
+	};
+	using InsnClassList_t = vector<InsnClass_t>;
+	using InsnClassScratch_t = ArenaVector_t<InsnClass_t>;   // a classification in an analysis thread's arena
+
 	// 
 	// a class to transform an IR by stamping (xoring) return addresses
 	//
 	class StackStamp_t : public Transform_t
 	{
 		public:
-			StackStamp_t(FileIR_t *p_variantIR, StampValue_t sv, bool p_verbose);
+			StackStamp_t(FileIR_t *p_variantIR, StampValue_t sv, LogLevel_t p_log_level=LogLevel_t::Function, size_t p_jobs=1);
 			bool execute();
 
+			// use a profile to choose which stampable functions to stamp.  The profile must outlive execute().
+			void setProfile(const Profile_t* p_profile, const ProfilePolicy_t& p_policy) { m_profile=p_profile; m_profile_policy=p_policy; }
+
+			// only transform the selected functions, e.g., to bisect a regression.  The selection must outlive execute().
+			void setSelection(const Selection_t* p_selection) { m_selection=p_selection; }
+
+			// count executions of the stamp sites, with or instead of stamping.  x86-64 only.
+			void setCounting(CountMode_t p_mode);
+
+			// skip leaf functions that provably can't overwrite their return address (see is_safe_leaf)
+			void setElideSafeLeaves(bool p_elide) { m_elide_safe_leaves=p_elide; }
+
+			// share one stamp between the returns of functions with at least this many returns (0=never), see consolidate_returns
+			void setConsolidateReturns(size_t p_min_returns) { m_consolidate_returns=p_min_returns; }
+
+			// put the EH stamp rule in every FDE program, even when one stamp value would let it go in the CIE programs
+			void setStampRuleInFDE(bool p_in_fde) { m_cie_stamp_rule=!p_in_fde && has_global_stamp(); }
+
 		private: 
+		// types, some declared here but defined below
+			using Clock_t = chrono::steady_clock;
+
+			// the phases of the transform that we time and report on, see report_phases
+			enum Phase_t
+			{
+				phSort,          // sorting the functions 
+				phFeasibility,   // analyzing (and planning) each function
+				phStamp,         // inserting stamps
+				phEhUpdate,      // updating EH programs
+				phRetarget,      // updating jumps to skip entry stamps
+				phCleanup,       // removing unused EH programs
+				phCount          // number of phases
+			};
+
+			struct EhProgramPlaceHolder_t;
+			struct FunctionAnalysis_t;
+			struct EhProgramMemoKeyHash_t;
+			struct IcfsSummary_t;
+			struct DecodeSummary_t;
+			struct AnalysisScratch_t;
+			using FunctionAnalysisList_t = vector<FunctionAnalysis_t>;
+			using PlaceholderPtr_t       = shared_ptr<const EhProgramPlaceHolder_t>;
+			using EhProgramMemoKey_t     = pair<const EhProgram_t*, StampValue_t>;  // an EH program and the stamp value applied to it
+			using PlaceholderMemo_t      = unordered_map<EhProgramMemoKey_t, PlaceholderPtr_t, EhProgramMemoKeyHash_t>;
+
 		// methods
 
+			// the functions, in the (deterministic) order to transform them
+			vector<Function_t*> sort_functions();
+
+			// decode each instruction in the function once, and record how it exits the function
+			// (and whether it might write the function's return address slot)
+			InsnClassScratch_t classify(Function_t* f, bool& frame_writes, AnalysisScratch_t& scratch);
+
+			// what classify (and is_safe_leaf) need from an instruction's decoding, memoized by encoding
+			const DecodeSummary_t& decode(Instruction_t* insn, AnalysisScratch_t& scratch);
+
+			// find the instructions that are fixed calls, before classifying any
+			void index_fixed_calls();
+
+			// summarize where each ICFS's targets are, and use that to classify an IB without scanning its targets
+			static IcfsSummary_t summarize_icfs(const ICFS_t* icfs);
+			void summarize_all_icfs();
+			ExitKind_t classify_ib(const ICFS_t* icfs, const Function_t* f) const;
+
 			// determine if we can stamp the given function
-			bool can_stamp(Function_t* f);
+			bool can_stamp(Function_t* f, const InsnClassScratch_t& classes, Instruction_t* &cond_exit);
+
+			// check if a function never uses its return address
+			bool never_returns(const InsnClassScratch_t& classes);
+
+			// check if a stampable function is a leaf that can't overwrite its return address
+			bool is_safe_leaf(Function_t* f, const InsnClassScratch_t& classes, bool frame_writes, AnalysisScratch_t& scratch);
+
+			// classify, check and plan the edits to a function without modifying the IR.  
+			// Safe to call from many threads at once, as long as each thread has its own placeholder memo.
+			FunctionAnalysis_t analyze(Function_t* f, AnalysisScratch_t& scratch);
+
+			// plan which instructions of a stampable function to stamp and retarget
+			void plan_stamps(Function_t* f, const InsnClassScratch_t& classes, FunctionAnalysis_t& fa);
+
+			// plan the EH program updates for a stampable function
+			void plan_eh_update(Function_t* f, FunctionAnalysis_t& fa, PlaceholderMemo_t& placeholders);
+
+			// build a placeholder for the stamped version of an EH program
+			PlaceholderPtr_t make_stamped_placeholder(const EhProgram_t* eh_pgm, StampValue_t sv);
+
+			// build the DWARF instruction that describes a stamped return address
+			EhProgramInstruction_t stamp_rule(StampValue_t sv);
+
+			// analyze funcs[first..last) into the same slots of analyses, using m_jobs threads.  Rethrows the first exception a thread threw.
+			void analyze_all(const vector<Function_t*>& funcs, size_t first, size_t last, FunctionAnalysisList_t& analyses);
+
+			// add a thread's scratch stats to ours, once the thread is done
+			void add_scratch_stats(const AnalysisScratch_t& scratch);
+
+			// use the profile to deselect stampable functions that would cost too much to stamp
+			void select_functions(const vector<Function_t*>& funcs, FunctionAnalysisList_t& analyses);
+
+			// report the profile's stats as ATTRIBUTEs
+			void report_profile();
 		
-			// stamp a function
-			void stamp(Function_t* f);
+			// stamp a function, given its analysis (and plan)
+			void stamp(Function_t* f, const FunctionAnalysis_t& fa);
+
+			// update the function's EH info to reflect the stamp, using the planned placeholders.  Called before the stamps are applied.
+			void eh_update(Function_t* f, const FunctionAnalysis_t& fa);
 
-			// update the function's EH info to reflect the stamp
-			void eh_update(Function_t* f);
+			// with the rule in the CIE, add it to the EH programs of the stamped functions once they are all stamped
+			void finish_cie_stamp_rules();
 
 			// after all eh-pgm re-use has happened, clean stuff up
 			void cleanup_eh_pgms();
 
-			// stamp an instruction in a function
-			Instruction_t* stamp(Function_t* f, Instruction_t* i);
+			// add the time since start to a phase
+			void end_phase(Phase_t phase, const Clock_t::time_point& start);
+
+			// record the peak RSS so far for phases that are done
+			void sample_peak_rss(const initializer_list<Phase_t>& phases);
+
+			// report the time, peak RSS and EH cache stats as ATTRIBUTEs
+			void report_phases();
+
+			// stamp an instruction in a function, given the encoded stamp instruction.  Returns the instruction now holding the original.
+			Instruction_t* stamp(Function_t* f, Instruction_t* i, const string& bits);
+
+			// insert a counter increment before an instruction.  Returns the instruction now holding the original.
+			Instruction_t* count(Function_t* f, Instruction_t* i);
+
+			// stamp and/or count a site, as the count mode says.  Returns the instruction now holding the original.
+			Instruction_t* instrument(Function_t* f, Instruction_t* i, const string& bits);
+
+			// create the data scoop for the counters, and fill it in once all the sites are known
+			void make_counter_scoop();
+			void finish_counter_scoop();
+
+			// apply all the stamps for a function in one pass:  the sites, the entry, and the jumps that skip the entry stamp
+			void apply_stamps(Function_t* f, const InsnClassList_t& sites, const vector<Instruction_t*>& retargets);
+
+			// share one stamp between a function's returns, if that's worth it.  Returns true if it did.
+			bool consolidate_returns(Function_t* f, const InsnClassList_t& sites, const string& bits);
+
+			// stamp the direct tail jumps deferred by apply_stamps, or fuse them with their target's entry stamp
+			void fuse_tail_jumps();
+
+			// get the machine code for the stamp instruction, encoded once per architecture and stamp value.
+			const string& stamp_encoding(StampValue_t sv);
 
 			// 
 			// get the stamp value for a function -- this is for future expansion
 			// if we want different stamp values per function.  Right now it
 			// just returns the global stamp value
 			// 
-			StampValue_t get_stamp(Function_t* f);
+			StampValue_t get_stamp(Function_t* f) const;
+
+			// 
+			// does get_stamp return the same value for every function?  If so, the EH programs 
+			// can describe the stamp once in the CIE program instead of in every FDE program.
+			// 
+			bool has_global_stamp() const;
 
 		// types
 			
@@ -89,7 +271,7 @@ namespace Stamper
 			{
 				// 
 				// these are the fields in an EH program
-				// we willb e changing only the FDE program, but need the others
+				// we willb e changing only the FDE (or CIE) program, but need the others
 				// to decide on equality of EH programs. 
 				//
 				uint8_t caf;                    // code alignment factor
@@ -99,6 +281,8 @@ namespace Stamper
 				EhProgramListing_t cie_program; // the DWARF program in the CIE
 				EhProgramListing_t fde_program; // the DWARF program in the FDE
 				RelocationSet_t relocs;         // any relocations for the EH program
+				uint64_t hash = 0;              // hash of all the above, see computeHash()
+				size_t bytes  = 0;              // the size of the CIE and FDE programs, see computeHash()
 
 				// getters
 				EhProgramListing_t& getCIEProgram() { return cie_program; }
@@ -121,22 +305,177 @@ namespace Stamper
 				{
 				}
 
+				// calculate the hash (and size) of this placeholder.  Must be called after the last edit to the 
+				// placeholder and before it is used as a key in the cache.
+				void computeHash();
+
+			};
+
+			// 
+			// The cache is hashed on the precomputed value, so a lookup costs one hash and, 
+			// if the hash matches, one deep comparison.
+			//
+			struct EhProgramPlaceHolderHash_t
+			{
+				size_t operator()(const EhProgramPlaceHolder_t& p) const { return (size_t)p.hash; }
+			};
+
+			// 
+			// A memo of which (stamped) EH program an original EH program became for a given stamp value.  
+			// Keyed by pointer, so a hit avoids building and comparing a placeholder at all.
+			//
+			struct EhProgramMemoKeyHash_t
+			{
+				size_t operator()(const EhProgramMemoKey_t& k) const 
+				{ 
+					return hash<const EhProgram_t*>()(k.first) ^ ((size_t)k.second * (size_t)0x9e3779b97f4a7c15ULL); 
+				}
+			};
+
+			// 
+			// The results of the read-only analysis of a function, including the plan of edits to make.
+			// These are calculated for all functions (possibly in parallel) before any function is modified.
+			// The plans are then applied one function at a time, in a deterministic order, so the output 
+			// does not depend on how many threads did the analysis.
+			//
+			struct FunctionAnalysis_t
+			{
+				bool in_selection         = true;     // selected by the user?  (see setSelection)  If not, nothing else is filled in.
+				bool stampable            = false;    // did can_stamp pass?
+				bool selected             = true;     // chosen for stamping?  (see select_functions)
+				bool never_returns        = false;    // stampable, but never uses its return address (see never_returns)
+				bool safe_leaf            = false;    // stampable, but provably needn't be (see is_safe_leaf)
+				Instruction_t* cond_exit  = nullptr;  // the conditional branch exit that prevented stamping, if any (for logging)
+
+				// the plan, only filled in for stampable functions
+				InsnClassList_t sites;                // instructions to stamp (the entry is always stamped after these)
+				vector<Instruction_t*> retargets;     // instructions that should jump past the entry's stamp
+				unordered_map<const EhProgram_t*, PlaceholderPtr_t> eh_placeholders; // the stamped placeholder for each EH program in the function
+			};
+
+			// 
+			// What classify and is_safe_leaf need to know about an instruction, see decode.
+			//
+			struct DecodeSummary_t
+			{
+				bool is_return               = false;
+				bool is_call                 = false;
+				bool is_unconditional_branch = false;
+				bool may_write_frame         = false;  // only checked when eliding safe leaves, see may_write_frame
+				bool pushes_frame_pointer    = false;  // likewise, see pushes_frame_pointer
+				int stack_delta              = 0;      // +1 for a push, -1 for a pop
+			};
+
+			// 
+			// An analysis thread's working storage.  The memos last the whole analysis, while the arena
+			// holds one function's scratch at a time, see analyze.
+			//
+			struct AnalysisScratch_t
+			{
+				PlaceholderMemo_t placeholders;                    // see plan_eh_update
+				unordered_map<string, DecodeSummary_t> decodes;    // see decode
+				Arena_t arena;                                     // see analyze
+				size_t decode_hits  = 0;                           // stats, decodes satisfied by the memo
+				size_t decodes_done = 0;                           // stats, instructions actually decoded
+			};
+
+			// 
+			// Where the targets of an ICFS are, see summarize_icfs.
+			//
+			struct IcfsSummary_t
+			{
+				const Function_t* only_function = nullptr;  // if all the targets are in one function (or none), that function
+				vector<const Function_t*> functions;        // otherwise, the targets' functions, sorted (empty if only_function applies)
 			};
 
 		// data 
 			StampValue_t m_stamp_value    = (StampValue_t)0; // how to stamp, for now this value is shared across all functions in the IR
-			bool m_verbose                = false;           // how verbose to be
+			Log_t m_log;                                     // where (and how much) to log
+			bool m_cie_stamp_rule         = false;           // put the EH stamp rule in the CIE program instead of the FDE program
+			size_t m_jobs                 = 1;               // how many threads to use for analysis (at most one per core)
+			bool m_elide_safe_leaves      = false;           // skip stamping leaves that can't write their return address
+			size_t m_consolidate_returns  = 0;               // share a stamp between returns in functions with this many (0=never)
+			EhProgramInstruction_t m_stamp_rule;             // stamp_rule(m_stamp_value), built once
+			string m_sp_name;                                // the stack pointer's name, for logging
+
+			// the encoded stamp instruction for each (architecture bit width, stamp value) pair, see stamp_encoding
+			map<pair<uint32_t, StampValue_t>, string> stamp_encodings;
+
+			// the profile (if any) and how to use it, see select_functions
+			const Profile_t* m_profile      = nullptr;
+			ProfilePolicy_t m_profile_policy;
+			unordered_map<const Function_t*, uint64_t> m_profile_samples;  // samples in each function
+
+			// the user's selection of functions (if any), see setSelection
+			const Selection_t* m_selection  = nullptr;
+
+			// the self-profiling counters, see count
+			CountMode_t m_count_mode         = CountMode_t::None;
+			DataScoop_t* m_counter_scoop     = nullptr;        // where the counters live
+			vector<VirtualOffset_t> m_counter_sites;           // the original address of each counted site, in counter order
+
+			// the direct tail jumps (and their functions) left for fuse_tail_jumps, and where each stamped function's
+			// entry stamp can be skipped
+			vector<pair<Instruction_t*, Function_t*> > m_tail_jumps;
+			unordered_map<const Function_t*, Instruction_t*> m_stamped_entries;
+
+			// the fixed calls, built before analysis and read-only after, see index_fixed_calls
+			unordered_set<const Instruction_t*> m_fixed_calls;
+
+			// each ICFS's summary, built before analysis and read-only after, see summarize_all_icfs
+			unordered_map<const ICFS_t*, IcfsSummary_t> m_icfs_summaries;
 
 			// a "cache" for EH programs (related to stack unwinding) so we can re-use newly created EH programs
-			map<EhProgramPlaceHolder_t, EhProgram_t*> all_eh_pgms;
+			unordered_map<EhProgramPlaceHolder_t, EhProgram_t*, EhProgramPlaceHolderHash_t> all_eh_pgms;
+
+			// a memo of original EH program (and stamp value) to the stamped EH program, see eh_update
+			unordered_map<EhProgramMemoKey_t, EhProgram_t*, EhProgramMemoKeyHash_t> stamped_eh_pgms;
+
+			// with the rule in the CIE:  how each EH program the stamped functions use is used, which programs 
+			// those are (in the order first seen), and the stamped functions.  See finish_cie_stamp_rules.
+			struct CieEhUses_t
+			{
+				bool shared = false;              // do instructions outside the stamped functions use it too?
+				vector<Function_t*> functions;    // the stamped functions that use it
+			};
+			unordered_map<EhProgram_t*, CieEhUses_t> m_cie_eh_uses;
+			vector<EhProgram_t*> m_cie_eh_pgms;
+			unordered_set<const Function_t*> m_cie_functions;
 
 		// stats 
 			int m_instructions_added        = 0;               // how many instructions were added
 			int m_functions_transformed     = 0;               // how many functions were transformed
 			int m_functions_not_transformed = 0;               // how many functions were skipped
+			size_t m_eh_memo_hits           = 0;               // EH program lookups satisfied by the pointer memo
+			size_t m_decodes                = 0;               // instructions decoded, see decode
+			size_t m_decode_memo_hits       = 0;               // decodes satisfied by the memo
+			size_t m_scratch_bytes          = 0;               // bytes of analysis scratch served by the arenas
+			size_t m_arena_allocations      = 0;               // scratch allocations the arenas served, that would otherwise have gone to the heap
+			size_t m_arena_blocks           = 0;               // blocks the arenas got from the heap (the decode memos and placeholders allocate on their own)
+			size_t m_eh_cache_hits          = 0;               // EH program lookups satisfied by the placeholder cache
+			size_t m_eh_cache_misses        = 0;               // EH programs created
+			size_t m_eh_bytes_saved         = 0;               // DWARF program bytes not duplicated thanks to hits
+			size_t m_eh_pgms_updated_in_place = 0;             // EH programs given the CIE rule without making a new program
+			double m_phase_seconds[phCount] = {};              // time spent in each phase
+			long m_phase_peak_rss_kb[phCount] = {};            // peak RSS at the end of each phase
+			int m_functions_profile_skipped = 0;               // stampable functions deselected by the profile
+			int m_functions_safe_leaves     = 0;               // stampable functions skipped as safe leaves
+			int m_functions_never_return    = 0;               // stampable functions skipped as they never return
+			size_t m_functions_not_selected = 0;               // functions outside the selection (or past its limit)
+			size_t m_selection_stopped_at   = 0;               // the index that phase 2 stopped at
+			size_t m_functions_examined     = 0;               // functions phase 1 looked at (analyzed, or marked as not selected)
+			size_t m_tail_jumps_fused       = 0;               // tail jumps that skip their target's entry stamp instead of being stamped
+			size_t m_functions_returns_consolidated = 0;       // functions whose returns share stamps
+			size_t m_returns_consolidated   = 0;               // returns in those functions
+			int64_t m_return_bytes_saved    = 0;               // bytes saved by sharing, versus a stamp per return
+			uint64_t m_profile_unmapped     = 0;               // profile samples outside every function
+			uint64_t m_profile_selected_samples = 0;           // samples in the functions selected for stamping
+			uint64_t m_profile_stamped_samples  = 0;           // samples in the functions actually stamped
+			double m_profile_predicted_coverage = 0;           // percent of functions selected for stamping
+			double m_profile_predicted_overhead = 0;           // predicted run-time overhead (percent) of the selection
 
 		// friends
-			friend bool operator<(const EhProgramPlaceHolder_t &a, const EhProgramPlaceHolder_t& b) ;
+			friend bool operator==(const EhProgramPlaceHolder_t &a, const EhProgramPlaceHolder_t& b) ;
 	};
 
 	// 
@@ -145,6 +484,6 @@ namespace Stamper
 	// notes:
 	//    Put the operator in the namespace for ADL (http://en.wikipedia.org/wiki/Argument-dependent_lookup)
 	//
-	bool operator<(const StackStamp_t::EhProgramPlaceHolder_t &a, const StackStamp_t::EhProgramPlaceHolder_t& b);
+	bool operator==(const StackStamp_t::EhProgramPlaceHolder_t &a, const StackStamp_t::EhProgramPlaceHolder_t& b);
 }
 #endif
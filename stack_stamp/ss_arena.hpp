@@ -0,0 +1,131 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _LIBTRANSFORM_SS_ARENA_H
+#define _LIBTRANSFORM_SS_ARENA_H
+
+#include <assert.h>
+#include <memory>
+#include <vector>
+
+//
+// using a namespace for code readability
+//
+namespace Stamper
+{
+	using namespace std;
+
+	//
+	// A bump allocator for scratch storage that lives only while one function is processed.
+	// Memory comes from large blocks and is given back all at once by reset(), which keeps the
+	// blocks.  So once the blocks are big enough for the largest function, containers that use
+	// an arena (see ArenaAllocator_t) don't touch the heap at all.
+	//
+	// Anything allocated from the arena must be destroyed (or at least never used) before reset().
+	// Not thread safe:  each analysis thread has its own.
+	//
+	class Arena_t
+	{
+		public:
+			Arena_t(size_t p_block_size=64*1024) : m_block_size(p_block_size) { }
+			Arena_t(const Arena_t&) = delete;
+			Arena_t& operator=(const Arena_t&) = delete;
+
+			// get memory for bytes, aligned to align (a power of two)
+			void* allocate(size_t bytes, size_t align)
+			{
+				assert(align!=0 && (align & (align-1))==0);
+				m_allocations++;
+				m_bytes_served+=bytes;
+				while(true)
+				{
+					if(m_current<m_blocks.size())
+					{
+						const auto &block=m_blocks[m_current];
+						const auto start=(m_used + align-1) & ~(align-1);
+						if(start+bytes <= block.size)
+						{
+							m_used=start+bytes;
+							return block.memory.get()+start;
+						}
+						m_current++;
+						m_used=0;
+						continue;
+					}
+
+					// out of blocks, so get one that's big enough from the heap.
+					const auto size=max(m_block_size, bytes+align);
+					m_blocks.push_back({unique_ptr<char[]>(new char[size]), size});
+					m_heap_blocks++;
+				}
+			}
+
+			// free everything at once, keeping the blocks for reuse
+			void reset() { m_current=0; m_used=0; }
+
+			// stats:  how many blocks came from the heap, and how many allocations and bytes were handed out in all
+			size_t heapBlocks() const { return m_heap_blocks; }
+			size_t allocations() const { return m_allocations; }
+			size_t bytesServed() const { return m_bytes_served; }
+
+		private:
+			struct Block_t
+			{
+				unique_ptr<char[]> memory;
+				size_t size;
+			};
+
+			size_t m_block_size;               // the usual size of a block
+			vector<Block_t> m_blocks;          // the blocks, in the order they're used
+			size_t m_current      = 0;         // the block we're allocating from
+			size_t m_used         = 0;         // how much of it is used
+			size_t m_heap_blocks  = 0;         // stats, see heapBlocks
+			size_t m_allocations  = 0;         // stats, see allocations
+			size_t m_bytes_served = 0;         // stats, see bytesServed
+	};
+
+	//
+	// A standard allocator that allocates from an Arena_t, so standard containers can use one.
+	// Deallocation does nothing; the memory comes back when the arena is reset.
+	//
+	template<class T>
+	class ArenaAllocator_t
+	{
+		public:
+			using value_type = T;
+
+			ArenaAllocator_t(Arena_t& p_arena) : m_arena(&p_arena) { }
+			template<class U> ArenaAllocator_t(const ArenaAllocator_t<U>& other) : m_arena(other.getArena()) { }
+
+			T* allocate(size_t n) { return static_cast<T*>(m_arena->allocate(n*sizeof(T), alignof(T))); }
+			void deallocate(T*, size_t) { }
+
+			Arena_t* getArena() const { return m_arena; }
+
+		private:
+			Arena_t* m_arena;
+	};
+
+	template<class T, class U>
+	bool operator==(const ArenaAllocator_t<T>& a, const ArenaAllocator_t<U>& b) { return a.getArena()==b.getArena(); }
+	template<class T, class U>
+	bool operator!=(const ArenaAllocator_t<T>& a, const ArenaAllocator_t<U>& b) { return a.getArena()!=b.getArena(); }
+
+	// a vector in an arena
+	template<class T>
+	using ArenaVector_t = vector<T, ArenaAllocator_t<T> >;
+}
+#endif
@@ -0,0 +1,75 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _LIBTRANSFORM_SS_ARGS_H
+#define _LIBTRANSFORM_SS_ARGS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <cmath>
+#include <limits>
+#include <string>
+
+//
+// using a namespace for code readability
+//
+namespace Stamper
+{
+	using namespace std;
+
+	//
+	// Strict parsers for the drivers' numeric options.  strtoul and strtod on their own accept junk 
+	// (and quietly give 0), and strtoul negates a leading minus sign.  These accept only a whole 
+	// argument that is in range, and say whether they did.
+	//
+
+	// a whole number that fits in T, in any base strtoull understands
+	template<class T>
+	inline bool parse_count(const string& arg, T& value)
+	{
+		if(arg.empty() || arg[0]=='-')
+			return false;
+		auto end=(char*)nullptr;
+		errno=0;
+		const auto parsed=strtoull(arg.c_str(), &end, 0);
+		if(*end!='\0' || errno==ERANGE || parsed>numeric_limits<T>::max())
+			return false;
+		value=(T)parsed;
+		return true;
+	}
+
+	// a finite number in [min_value, max_value]
+	inline bool parse_number(const string& arg, double min_value, double max_value, double& value)
+	{
+		if(arg.empty())
+			return false;
+		auto end=(char*)nullptr;
+		errno=0;
+		const auto parsed=strtod(arg.c_str(), &end);
+		if(*end!='\0' || errno==ERANGE || !isfinite(parsed) || parsed<min_value || parsed>max_value)
+			return false;
+		value=parsed;
+		return true;
+	}
+
+	// a percentage, 0 to 100
+	inline bool parse_percent(const string& arg, double& value)
+	{
+		return parse_number(arg, 0, 100, value);
+	}
+}
+#endif
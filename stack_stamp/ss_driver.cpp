@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "ss.hpp"
+#include "ss_args.hpp"
 
 using namespace std;
 using namespace IRDB_SDK;
@@ -60,10 +61,28 @@ class StackStampDriver_t : public TransformStep_t
 			stamp_value=rand();
 
 			// declare getopts values 
-			const auto short_opts="s:v?h";
+			const auto short_opts="s:j:l:vqp:H:C:B:kKLo:Ey:x:a:d:P:m:?h";
 			struct option long_options[] = {
 				{"stamp-value", required_argument, 0, 's'},
+				{"jobs", required_argument, 0, 'j'},
+				{"log-level", required_argument, 0, 'l'},
 				{"verbose", no_argument, 0, 'v'},
+				{"quiet", no_argument, 0, 'q'},
+				{"profile", required_argument, 0, 'p'},
+				{"skip-hottest", required_argument, 0, 'H'},
+				{"min-coverage", required_argument, 0, 'C'},
+				{"overhead-budget", required_argument, 0, 'B'},
+				{"counters", no_argument, 0, 'k'},
+				{"counters-only", no_argument, 0, 'K'},
+				{"elide-safe-leaves", no_argument, 0, 'L'},
+				{"consolidate-returns", required_argument, 0, 'o'},
+				{"fde-stamp-rule", no_argument, 0, 'E'},
+				{"include", required_argument, 0, 'y'},
+				{"exclude", required_argument, 0, 'x'},
+				{"address-ranges", required_argument, 0, 'a'},
+				{"index-ranges", required_argument, 0, 'd'},
+				{"sample", required_argument, 0, 'P'},
+				{"max-functions", required_argument, 0, 'm'},
 				{"help", no_argument, 0, 'h'},
 				{"usage", no_argument, 0, '?'},
 				{0,0,0,0}
@@ -79,9 +98,140 @@ class StackStampDriver_t : public TransformStep_t
 					case 's': 
 						stamp_value=strtoul(optarg,NULL,0);
 						break;
+					case 'j': 
+					{
+						if(!parse_count(optarg, jobs) || jobs==0)
+						{
+							cerr<<"Bad number of jobs: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						break;
+					}
+					case 'l': 
+					{
+						const auto level=string(optarg);
+						if     (level=="summary"  || level=="0") log_level=LogLevel_t::Summary;
+						else if(level=="function" || level=="1") log_level=LogLevel_t::Function;
+						else if(level=="site"     || level=="2") log_level=LogLevel_t::Site;
+						else
+						{
+							cerr<<"Unknown log level: "<<level<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						break;
+					}
 					case 'v': 
-						verbose=true;
+						log_level=LogLevel_t::Site;
+						break;
+					case 'q': 
+						log_level=LogLevel_t::Summary;
+						break;
+					case 'p': 
+					{
+						auto error=string();
+						if(!profile.load(optarg, error))
+						{
+							cerr<<error<<endl;
+							return 1;
+						}
+						use_profile=true;
+						break;
+					}
+					case 'H': 
+						if(!parse_count(optarg, profile_policy.skip_hottest))
+						{
+							cerr<<"Bad number of hottest functions to skip: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						break;
+					case 'C': 
+						if(!parse_percent(optarg, profile_policy.min_coverage_pct))
+						{
+							cerr<<"Bad coverage percentage: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						break;
+					case 'B': 
+						if(!parse_number(optarg, 0, numeric_limits<double>::max(), profile_policy.overhead_budget_pct))
+						{
+							cerr<<"Bad overhead budget: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						break;
+					case 'k': 
+						count_mode=CountMode_t::WithStamps;
+						break;
+					case 'K': 
+						count_mode=CountMode_t::Instead;
+						break;
+					case 'L': 
+						elide_safe_leaves=true;
+						break;
+					case 'o': 
+						if(!parse_count(optarg, consolidate_returns))
+						{
+							cerr<<"Bad number of returns to consolidate: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						break;
+					case 'E': 
+						fde_stamp_rule=true;
+						break;
+					case 'y': 
+					case 'x': 
+					case 'a': 
+					case 'd': 
+					{
+						auto error=string();
+						const auto ok = 
+							c=='y' ? selection.addIncludes(optarg, error) :
+							c=='x' ? selection.addExcludes(optarg, error) :
+							c=='a' ? selection.addAddressRanges(optarg, error) :
+							         selection.addIndexRanges(optarg, error) ;
+						if(!ok)
+						{
+							cerr<<error<<endl;
+							return 1;
+						}
+						use_selection=true;
+						break;
+					}
+					case 'P': 
+					{
+						// pct[:seed]
+						const auto arg=string(optarg);
+						const auto colon=arg.find(':');
+						auto pct=0.0;
+						auto seed=uint64_t(0);
+						if(!parse_percent(arg.substr(0, colon), pct) || (colon!=string::npos && !parse_count(arg.substr(colon+1), seed)))
+						{
+							cerr<<"Bad sample: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						selection.setSample(pct, seed);
+						use_selection=true;
+						break;
+					}
+					case 'm': 
+					{
+						auto max_functions=size_t(0);
+						if(!parse_count(optarg, max_functions))
+						{
+							cerr<<"Bad maximum number of functions: "<<optarg<<endl;
+							usage(argv[0]);
+							return 1;
+						}
+						selection.setMaxFunctions(max_functions);
+						use_selection=true;
 						break;
+					}
 					case '?':
 					case 'h':
 						usage(argv[0]);
@@ -113,7 +263,16 @@ class StackStampDriver_t : public TransformStep_t
 				auto firp=getMainFileIR();
 
 				// execute a transform.
-				const auto success= StackStamp_t(firp, stamp_value, verbose).execute();
+				StackStamp_t ss(firp, stamp_value, log_level, jobs);  // StackStamp_t has no copy constructor, cannot use auto style decls.
+				if(use_profile)
+					ss.setProfile(&profile, profile_policy);
+				ss.setCounting(count_mode);
+				ss.setElideSafeLeaves(elide_safe_leaves);
+				ss.setConsolidateReturns(consolidate_returns);
+				ss.setStampRuleInFDE(fde_stamp_rule);
+				if(use_selection)
+					ss.setSelection(&selection);
+				const auto success=ss.execute();
 
 				// return success status
 				return success ? 0 : 2; // bash-style, 0=success, 1=warnings, 2=errors
@@ -144,8 +303,18 @@ class StackStampDriver_t : public TransformStep_t
 	private:
 	// data
 		const string program_name = string("stack_stamp");   // this programs nam
-		bool verbose             = false;                    // use verbose mode?
+		LogLevel_t log_level     = LogLevel_t::Function;     // how much to log?
 		StampValue_t stamp_value=-1;                // how should we stamp?
+		size_t jobs              = 1;                        // how many analysis threads? (capped at one per core)
+		bool use_profile         = false;                    // was a profile given?
+		Profile_t profile;                                   // the profile, if any
+		ProfilePolicy_t profile_policy;                      // how to use the profile
+		CountMode_t count_mode   = CountMode_t::None;        // count executions of stamp sites?
+		bool elide_safe_leaves   = false;                    // skip leaves that can't write their return address?
+		size_t consolidate_returns = 0;                      // share a stamp between this many returns or more (0=never)
+		bool fde_stamp_rule      = false;                    // put the EH stamp rule in each FDE, not the CIEs?
+		bool use_selection       = false;                    // was a selection of functions given?
+		Selection_t selection;                               // the selection, if any
 
 	// methods
 		
@@ -157,8 +326,44 @@ class StackStampDriver_t : public TransformStep_t
 			cerr<<"Usage: "<<name<<endl;
 			cerr<<"\t--stamp-value <value>         Set the stamp value that will be used.  "<<endl;
 			cerr<<"\t-s <value>                    (as parsed by by strtoul)               "<<endl;
-			cerr<<"\t--verbose	                   Verbose mode.                           "<<endl;
+			cerr<<"\t--jobs <n>                    Analyze functions with <n> threads.     "<<endl;
+			cerr<<"\t-j <n>                        (at most one per core, default 1)       "<<endl;
+			cerr<<"\t--log-level <level>           How much to log:  summary, function     "<<endl;
+			cerr<<"\t-l <level>                    (the default), or site.                 "<<endl;
+			cerr<<"\t--verbose	                   Verbose mode, same as --log-level site. "<<endl;
 			cerr<<"\t-v                                                                    "<<endl;
+			cerr<<"\t--quiet                       Quiet mode, same as --log-level summary."<<endl;
+			cerr<<"\t-q                                                                    "<<endl;
+			cerr<<"\t--profile <file>              Choose functions to stamp from a profile:  "<<endl;
+			cerr<<"\t-p <file>                     perf script output, or address/count lines."<<endl;
+			cerr<<"\t--skip-hottest <n>            With a profile, never stamp the <n> most   "<<endl;
+			cerr<<"\t-H <n>                        sampled functions.                         "<<endl;
+			cerr<<"\t--min-coverage <pct>          With a profile, stamp at least <pct>% of   "<<endl;
+			cerr<<"\t-C <pct>                      functions, cheapest first.                 "<<endl;
+			cerr<<"\t--overhead-budget <pct>       With a profile, stamp (cheapest first)     "<<endl;
+			cerr<<"\t-B <pct>                      while predicted overhead is under <pct>%.  "<<endl;
+			cerr<<"\t--counters                    Also count executions of each stamp site;  "<<endl;
+			cerr<<"\t-k                            preload libss_counters.so to dump them.    "<<endl;
+			cerr<<"\t--counters-only               Count stamp sites, but do not stamp.       "<<endl;
+			cerr<<"\t-K                                                                       "<<endl;
+			cerr<<"\t--elide-safe-leaves           Do not stamp leaf functions that provably  "<<endl;
+			cerr<<"\t-L                            never write their return address slot.     "<<endl;
+			cerr<<"\t--consolidate-returns <n>     In functions with <n> or more returns, have"<<endl;
+			cerr<<"\t-o <n>                        them share one stamp, if that saves bytes. "<<endl;
+			cerr<<"\t--fde-stamp-rule              Describe the stamp in every FDE's unwind   "<<endl;
+			cerr<<"\t-E                            program, instead of once in the CIEs.      "<<endl;
+			cerr<<"\t--include <names>              Only transform these functions:  a comma   "<<endl;
+			cerr<<"\t-y <names>                     separated list, or @file with one per line."<<endl;
+			cerr<<"\t--exclude <names>              Never transform these functions (same     "<<endl;
+			cerr<<"\t-x <names>                     format as --include).                     "<<endl;
+			cerr<<"\t--address-ranges <ranges>      Only transform functions with entries in   "<<endl;
+			cerr<<"\t-a <ranges>                    these hex ranges, e.g., 0x401000-0x402000. "<<endl;
+			cerr<<"\t--index-ranges <ranges>        Only transform functions at these indices  "<<endl;
+			cerr<<"\t-d <ranges>                    of the sorted order, e.g., 0-499,1000.     "<<endl;
+			cerr<<"\t--sample <pct>[:<seed>]        Only transform about <pct>% of functions,  "<<endl;
+			cerr<<"\t-P <pct>[:<seed>]              picked by hashing their names.             "<<endl;
+			cerr<<"\t--max-functions <n>            Stop after transforming <n> functions.     "<<endl;
+			cerr<<"\t-m <n>                                                                   "<<endl;
 			cerr<<"--help,--usage,-?,-h            Display this message                    "<<endl;
 		}
 
@@ -0,0 +1,135 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _LIBTRANSFORM_SS_LOG_H
+#define _LIBTRANSFORM_SS_LOG_H
+
+#include <iostream>
+#include <streambuf>
+#include <string>
+
+//
+// using a namespace for code readability
+//
+namespace Stamper
+{
+	using namespace std;
+
+	//
+	// How much to log.  Each level includes the ones before it.
+	//
+	enum class LogLevel_t
+	{
+		Summary  = 0,   // stats and anomalies only
+		Function = 1,   // plus a line per function (the default)
+		Site     = 2    // plus a line per stamp site (aka verbose)
+	};
+
+	//
+	// A stream buffer that collects output in a large string instead of writing it.
+	// Nothing is written until the owner calls flush_to, so endl is cheap.
+	//
+	class LogBuffer_t : public streambuf
+	{
+		public:
+			LogBuffer_t(size_t p_capacity) : m_capacity(p_capacity) { m_buffer.reserve(m_capacity); }
+
+			// is the buffer full enough that we should write it out?
+			bool full() const { return m_buffer.size() >= m_capacity; }
+
+			// write the buffered output, and empty the buffer (but keep its memory)
+			void flush_to(ostream& out)
+			{
+				out.write(m_buffer.data(), m_buffer.size());
+				out.flush();
+				m_buffer.clear();
+			}
+
+		protected:
+			// required overrides:  how to take characters
+			int_type overflow(int_type c) override
+			{
+				if(c != traits_type::eof())
+					m_buffer.push_back(traits_type::to_char_type(c));
+				return traits_type::not_eof(c);
+			}
+			streamsize xsputn(const char* s, streamsize n) override
+			{
+				m_buffer.append(s, (size_t)n);
+				return n;
+			}
+
+		private:
+			size_t m_capacity;   // when to consider ourselves full
+			string m_buffer;     // the output so far
+	};
+
+	//
+	// A leveled, buffered log.  Use with SS_LOG so that the arguments to a line that won't
+	// be logged aren't even evaluated.  Output is written when flush() is called (typically at
+	// the end of a phase), when the buffer gets very large, or when the log is destroyed.
+	//
+	class Log_t
+	{
+		public:
+			Log_t(LogLevel_t p_level, ostream& p_out=cout, size_t p_capacity=16*1024*1024)
+				:
+				m_level(p_level),
+				m_out(p_out),
+				m_buffer(p_capacity),
+				m_stream(&m_buffer)
+			{
+			}
+			~Log_t() { flush(); }
+
+			// no copying, the stream refers to our buffer.
+			Log_t(const Log_t&) = delete;
+			Log_t& operator=(const Log_t&) = delete;
+
+			// should lines at this level be logged?
+			bool enabled(LogLevel_t l) const { return l <= m_level; }
+
+			// where to write a line, see SS_LOG.
+			ostream& stream()
+			{
+				// bound memory use if someone logs a lot between flushes
+				if(m_buffer.full())
+					flush();
+				return m_stream;
+			}
+
+			// write out anything buffered.
+			void flush() { m_buffer.flush_to(m_out); }
+
+		private:
+			LogLevel_t  m_level;    // how much to log
+			ostream&    m_out;      // where to write
+			LogBuffer_t m_buffer;   // the buffer
+			ostream     m_stream;   // a stream on the buffer
+	};
+}
+
+//
+// Log a line at a given level, e.g.:
+//
+// 	SS_LOG(m_log, LogLevel_t::Function) << "Doing " << f->getName() << endl;
+//
+// The dangling-else form makes this safe to use as a statement anywhere, and skips evaluating
+// the rest of the line when the level is not enabled.
+//
+#define SS_LOG(log, level) if(!(log).enabled(level)) ; else (log).stream()
+
+#endif
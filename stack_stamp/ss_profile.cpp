@@ -0,0 +1,155 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
+#include "ss_profile.hpp"
+
+using namespace std;
+using namespace IRDB_SDK;
+using namespace Stamper;
+
+#define ALLOF(a) begin(a), end(a)
+
+//
+// Parse a hex number (with or without 0x), requiring the whole string be used.
+//
+static bool parse_hex(const string& s, uint64_t& value)
+{
+	if(s.empty())
+		return false;
+	auto end=(char*)nullptr;
+	value=strtoull(s.c_str(), &end, 16);
+	return *end=='\0';
+}
+
+//
+// Parse a decimal number, requiring the whole string be used.
+//
+static bool parse_dec(const string& s, uint64_t& value)
+{
+	if(s.empty() || !isdigit((unsigned char)s[0]))
+		return false;
+	auto end=(char*)nullptr;
+	value=strtoull(s.c_str(), &end, 10);
+	return *end=='\0';
+}
+
+//
+// Parse a line of either profile format, see ss_profile.hpp.
+//
+bool Profile_t::parse_line(const string& line, VirtualOffset_t& addr, uint64_t& count)
+{
+	// split into tokens
+	istringstream in(line); // istringstream has no copy constructor, cannot use auto style decls.
+	auto tokens=vector<string>();
+	for(auto token=string(); in >> token; )
+		tokens.push_back(token);
+
+	// blank lines and comments
+	if(tokens.empty() || tokens[0][0]=='#')
+		return false;
+
+	// format 1:  address [count]
+	if(tokens.size()<=2 && parse_hex(tokens[0], addr))
+	{
+		count=1;
+		return tokens.size()==1 || parse_dec(tokens[1], count);
+	}
+
+	// format 2:  perf script.  The time is also followed by a colon, so the event is the first
+	// colon-terminated token that isn't a number.
+	for(auto i=size_t(0); i+1<tokens.size(); i++)
+	{
+		const auto &t=tokens[i];
+		if(t.back()!=':')
+			continue;
+		const auto is_time=all_of(t.begin(), t.end()-1, [](const char c) { return isdigit((unsigned char)c) || c=='.'; });
+		if(is_time)
+			continue;
+
+		count=1;
+		return parse_hex(tokens[i+1], addr);
+	}
+
+	// call chain lines, headers, or something else we don't know.
+	return false;
+}
+
+//
+// Read a profile.
+//
+bool Profile_t::load(const string& filename, string& error)
+{
+	ifstream in(filename); // ifstream has no copy constructor, cannot use auto style decls.
+	if(!in)
+	{
+		error="cannot open profile "+filename;
+		return false;
+	}
+
+	auto addr=VirtualOffset_t(0);
+	auto count=uint64_t(0);
+	for(auto line=string(); getline(in, line); )
+	{
+		if(!parse_line(line, addr, count))
+			continue;
+		m_samples[addr]+=count;
+		m_total+=count;
+	}
+	return true;
+}
+
+//
+// Attribute samples to functions.  Each sample goes to the function of the instruction at or just
+// before its address, so samples anywhere in a function count, not just those at its entry.
+//
+unordered_map<const Function_t*, uint64_t> Profile_t::byFunction(const FileIR_t* firp, uint64_t& unmapped) const
+{
+	// the instructions that have an address in the original program, sorted by that address
+	auto by_addr=vector<pair<VirtualOffset_t, const Instruction_t*> >();
+	by_addr.reserve(firp->getInstructions().size());
+	for(const auto insn : firp->getInstructions())
+	{
+		const auto addr=insn->getAddress()->getVirtualOffset();
+		if(addr!=0 && insn->getFunction()!=nullptr)
+			by_addr.push_back({addr, insn});
+	}
+	sort(ALLOF(by_addr), [](const pair<VirtualOffset_t, const Instruction_t*>& a, const pair<VirtualOffset_t, const Instruction_t*>& b)
+		{ return a.first < b.first; });
+
+	auto result=unordered_map<const Function_t*, uint64_t>();
+	unmapped=0;
+	for(const auto &sample : m_samples)
+	{
+		// find the last instruction at or before the sample.
+		auto it=upper_bound(ALLOF(by_addr), sample.first, [](const VirtualOffset_t addr, const pair<VirtualOffset_t, const Instruction_t*>& p)
+			{ return addr < p.first; });
+
+		// the sample must be inside that instruction, else it's in code we don't know about (e.g., a library).
+		const auto found= it!=by_addr.begin() &&
+		                  sample.first < prev(it)->first + max<size_t>(prev(it)->second->getDataBits().size(), 1);
+		if(found)
+			result[prev(it)->second->getFunction()]+=sample.second;
+		else
+			unmapped+=sample.second;
+	}
+	return result;
+}
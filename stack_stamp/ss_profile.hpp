@@ -0,0 +1,83 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _LIBTRANSFORM_SS_PROFILE_H
+#define _LIBTRANSFORM_SS_PROFILE_H
+
+#include <irdb-core>
+#include <map>
+#include <unordered_map>
+
+//
+// using a namespace for code readability
+//
+namespace Stamper
+{
+	// std and IRDB namespaces needed
+	using namespace std;
+	using namespace IRDB_SDK;
+
+	//
+	// How to pick which stampable functions to stamp, given a profile.  See StackStamp_t::select_functions.
+	//
+	struct ProfilePolicy_t
+	{
+		size_t skip_hottest        = 0;     // never stamp this many of the most-sampled functions
+		double min_coverage_pct    = 0;     // stamp at least this percent of all functions, budget or not
+		double overhead_budget_pct = -1;    // stamp (cheapest first) while the predicted overhead stays under this.  <0 means no budget.
+	};
+
+	//
+	// An execution profile:  how many samples were taken at each address.
+	//
+	// Two formats are read, and may be mixed in one file:
+	//
+	//    1) "address count" or "address" lines, with the address in hex (0x is optional) and the
+	//       count in decimal (default 1).
+	//    2) The output of "perf script", where the address follows the event name, e.g.:
+	//
+	//          prog 1234 5678.123456:     250000 cycles:u:  401136 helper+0x16 (/path/to/prog)
+	//
+	//       Only the sampled address is used;  call chain lines (from perf record -g) are ignored.
+	//
+	// The addresses must be the program's link-time addresses, so profiles of position independent
+	// programs need to be recorded with ASLR disabled and the load bias removed.
+	//
+	class Profile_t
+	{
+		public:
+			// read a profile, returning false (with a message in error) if the file can't be read
+			bool load(const string& filename, string& error);
+
+			// is there anything in the profile?
+			bool empty() const { return m_samples.empty(); }
+
+			// how many samples in total
+			uint64_t totalSamples() const { return m_total; }
+
+			// attribute every sample to the function containing its address.  Samples that land
+			// outside every function are counted in unmapped.
+			unordered_map<const Function_t*, uint64_t> byFunction(const FileIR_t* firp, uint64_t& unmapped) const;
+
+		private:
+			// parse one line into an address and count, returning false if there's no sample on the line
+			static bool parse_line(const string& line, VirtualOffset_t& addr, uint64_t& count);
+
+			map<VirtualOffset_t, uint64_t> m_samples;   // address -> samples
+			uint64_t m_total = 0;                       // sum of the above
+	};
+}
+#endif
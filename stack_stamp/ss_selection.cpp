@@ -0,0 +1,210 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include "ss_selection.hpp"
+
+using namespace std;
+using namespace IRDB_SDK;
+using namespace Stamper;
+
+#define ALLOF(a) begin(a), end(a)
+
+//
+// Parse a number in the given base, requiring the whole string be used.
+//
+static bool parse_number(const string& s, int base, uint64_t& value)
+{
+	if(s.empty() || s[0]=='-')
+		return false;
+	auto end=(char*)nullptr;
+	value=strtoull(s.c_str(), &end, base);
+	return *end=='\0';
+}
+
+//
+// Read names from a spec, see Selection_t::addIncludes.
+//
+bool Selection_t::add_names(const string& spec, unordered_set<string>& names, string& error)
+{
+	// @file:  one name per line, blank lines and comments ignored
+	if(!spec.empty() && spec[0]=='@')
+	{
+		const auto filename=spec.substr(1);
+		ifstream in(filename); // ifstream has no copy constructor, cannot use auto style decls.
+		if(!in)
+		{
+			error="cannot open function list "+filename;
+			return false;
+		}
+		for(auto line=string(); getline(in, line); )
+		{
+			const auto first=line.find_first_not_of(" \t\r");
+			if(first==string::npos || line[first]=='#')
+				continue;
+			const auto last=line.find_last_not_of(" \t\r");
+			names.insert(line.substr(first, last-first+1));
+		}
+		return true;
+	}
+
+	// otherwise, a comma separated list
+	istringstream in(spec); // istringstream has no copy constructor, cannot use auto style decls.
+	for(auto name=string(); getline(in, name, ','); )
+		if(!name.empty())
+			names.insert(name);
+	return true;
+}
+
+//
+// Read ranges from a spec, see Selection_t::addAddressRanges.  The ranges are kept sorted and merged
+// so that a lookup is a binary search, however many ranges there are.
+//
+bool Selection_t::add_ranges(const string& spec, int base, bool exclusive_end, vector<Range_t>& ranges, string& error)
+{
+	istringstream in(spec); // istringstream has no copy constructor, cannot use auto style decls.
+	for(auto item=string(); getline(in, item, ','); )
+	{
+		if(item.empty())
+			continue;
+
+		const auto dash=item.find('-');
+		auto first=uint64_t(0);
+		auto last=uint64_t(0);
+		const auto ok = dash==string::npos
+			? parse_number(item, base, first) && parse_number(item, base, last)
+			: parse_number(item.substr(0, dash), base, first) && parse_number(item.substr(dash+1), base, last);
+		if(!ok || last<first || (dash!=string::npos && exclusive_end && last==first))
+		{
+			error="bad range: "+item;
+			return false;
+		}
+
+		// single values are themselves, otherwise make the end inclusive.
+		if(dash!=string::npos && exclusive_end)
+			last--;
+		ranges.push_back({first, last});
+	}
+
+	// sort and merge overlapping (or touching) ranges
+	sort(ALLOF(ranges));
+	auto merged=vector<Range_t>();
+	for(const auto &r : ranges)
+	{
+		const auto touches= !merged.empty() && (merged.back().second==numeric_limits<uint64_t>::max() || r.first <= merged.back().second+1);
+		if(touches)
+			merged.back().second=max(merged.back().second, r.second);
+		else
+			merged.push_back(r);
+	}
+	ranges.swap(merged);
+	return true;
+}
+
+bool Selection_t::addAddressRanges(const string& spec, string& error)
+{
+	return add_ranges(spec, 16, true, m_address_ranges, error);
+}
+
+bool Selection_t::addIndexRanges(const string& spec, string& error)
+{
+	return add_ranges(spec, 10, false, m_index_ranges, error);
+}
+
+//
+// Find the last range that starts at or before value, and check that value is in it.
+//
+bool Selection_t::in_ranges(const vector<Range_t>& ranges, uint64_t value)
+{
+	const auto it=upper_bound(ALLOF(ranges), value, [](const uint64_t v, const Range_t& r) { return v < r.first; });
+	return it!=ranges.begin() && value <= prev(it)->second;
+}
+
+//
+// A function is in the sample if the hash of its name (FNV-1a, mixed with the seed) lands in the
+// first pct percent of hash values.  Names, unlike pointers or IDs, are the same from run to run.
+//
+bool Selection_t::sampled(const string& name) const
+{
+	if(m_sample_pct>=100)
+		return true;
+	if(m_sample_pct<=0)
+		return false;
+
+	auto hash=uint64_t(0xcbf29ce484222325ull) ^ (m_sample_seed * 0x9e3779b97f4a7c15ull);
+	for(const auto c : name)
+	{
+		hash^=(uint8_t)c;
+		hash*=0x100000001b3ull;
+	}
+
+	// the low bits of FNV-1a mix poorly, so fold the high bits in before picking a bucket.
+	hash^=hash>>32;
+	return (hash % 10000) < (uint64_t)(m_sample_pct*100);
+}
+
+//
+// Check each filter that was given, cheapest first.
+//
+bool Selection_t::selects(const Function_t* f, size_t index) const
+{
+	if(!m_index_ranges.empty() && !in_ranges(m_index_ranges, index))
+		return false;
+
+	if(!m_address_ranges.empty())
+	{
+		const auto entry=f->getEntryPoint();
+		if(entry==nullptr || !in_ranges(m_address_ranges, entry->getAddress()->getVirtualOffset()))
+			return false;
+	}
+
+	const auto &name=f->getName();
+	if(!m_includes.empty() && m_includes.find(name)==m_includes.end())
+		return false;
+	if(m_excludes.find(name)!=m_excludes.end())
+		return false;
+
+	return sampled(name);
+}
+
+//
+// The index ranges bound the indices that can be selected.  The functions are in name order, so an 
+// include list's last function is found by a binary search per name.  Entry addresses (and the 
+// sample) don't follow that order, so from there, walk back to the last function that's selected.
+// That's one cheap check per function skipped, instead of analyzing it.
+//
+size_t Selection_t::endIndex(const vector<Function_t*>& funcs) const
+{
+	auto end=funcs.size();
+	if(!m_index_ranges.empty() && end>0)
+		end=(size_t)min<uint64_t>(m_index_ranges.back().second, end-1)+1;
+
+	if(!m_includes.empty())
+	{
+		const auto by_name=[](const string& name, const Function_t* f) { return name < f->getName(); };
+		auto last_included=size_t(0);
+		for(const auto &name : m_includes)
+			last_included=max(last_included, (size_t)(upper_bound(funcs.begin(), funcs.begin()+end, name, by_name)-funcs.begin()));
+		end=last_included;
+	}
+
+	while(end>0 && !selects(funcs[end-1], end-1))
+		end--;
+	return end;
+}
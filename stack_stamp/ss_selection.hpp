@@ -0,0 +1,99 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _LIBTRANSFORM_SS_SELECTION_H
+#define _LIBTRANSFORM_SS_SELECTION_H
+
+#include <irdb-core>
+#include <limits>
+#include <unordered_set>
+#include <vector>
+
+//
+// using a namespace for code readability
+//
+namespace Stamper
+{
+	// std and IRDB namespaces needed
+	using namespace std;
+	using namespace IRDB_SDK;
+
+	//
+	// Which functions the transform may touch, e.g., to bisect which stamped functions cause a
+	// performance regression.  See StackStamp_t::setSelection.
+	//
+	// Functions can be chosen by:
+	//
+	//    1) name:  include and exclude lists.  Exclusion always wins.
+	//    2) entry address:  ranges of link-time addresses, [first, last).
+	//    3) index:  ranges of positions in the transform's (deterministic) order of functions, [first, last].
+	//    4) sampling:  a percentage of functions, chosen by a hash of their names, so the same seed
+	//       picks the same functions from run to run.
+	//
+	// A function must pass every kind of filter that was given, and match any one of a kind's entries.
+	// With no filters at all, every function is selected.  Separately, the transform stops after
+	// maxFunctions() functions are transformed.
+	//
+	class Selection_t
+	{
+		public:
+			// name lists.  spec is a comma separated list of names, or @file for a file of names, one per line.
+			bool addIncludes(const string& spec, string& error) { return add_names(spec, m_includes, error); }
+			bool addExcludes(const string& spec, string& error) { return add_names(spec, m_excludes, error); }
+
+			// ranges.  spec is a comma separated list of ranges (first-last) or single values.  Addresses are in hex
+			// (0x is optional), indices in decimal.
+			bool addAddressRanges(const string& spec, string& error);
+			bool addIndexRanges(const string& spec, string& error);
+
+			// select about pct percent of the functions.  Different seeds select different functions.
+			void setSample(double pct, uint64_t seed=0) { m_sample_pct=pct; m_sample_seed=seed; }
+
+			// stop after transforming this many functions
+			void setMaxFunctions(size_t n) { m_max_functions=n; }
+			size_t maxFunctions() const { return m_max_functions; }
+
+			// is the function, at the given index in the transform's order, selected?
+			bool selects(const Function_t* f, size_t index) const;
+
+			// one past the last selected index of funcs, which must be in the transform's order (by name)
+			size_t endIndex(const vector<Function_t*>& funcs) const;
+
+		private:
+			using Range_t = pair<uint64_t, uint64_t>;  // [first, last], inclusive
+
+			// parse a name list spec into names
+			static bool add_names(const string& spec, unordered_set<string>& names, string& error);
+
+			// parse a range list spec into ranges, with values in the given base
+			static bool add_ranges(const string& spec, int base, bool exclusive_end, vector<Range_t>& ranges, string& error);
+
+			// is value in one of the (sorted, merged) ranges?
+			static bool in_ranges(const vector<Range_t>& ranges, uint64_t value);
+
+			// is the name in the sample?
+			bool sampled(const string& name) const;
+
+			unordered_set<string> m_includes;        // names to include (empty means all)
+			unordered_set<string> m_excludes;        // names to exclude
+			vector<Range_t> m_address_ranges;        // entry addresses to include, sorted and merged (empty means all)
+			vector<Range_t> m_index_ranges;          // indices to include, sorted and merged (empty means all)
+			double m_sample_pct      = 100;          // percent of functions to sample
+			uint64_t m_sample_seed   = 0;            // which sample
+			size_t m_max_functions   = numeric_limits<size_t>::max();  // stop after this many
+	};
+}
+#endif
@@ -0,0 +1,329 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include <chrono>
+#include <getopt.h>
+#include <irdb-core>
+#include "ss.hpp"
+#include "ss_args.hpp"
+#include "bench/synth_ir.hpp"
+
+using namespace std;
+using namespace IRDB_SDK;
+using namespace Stamper;
+
+//
+// Count heap allocations, to see how much allocator traffic the transform makes.  This is a program
+// of its own, so replacing the global operator new here affects nothing else.  They're kept out of line,
+// else gcc sees free() called on what "new" returned and warns.
+//
+static atomic<size_t> heap_allocations(0); // atomics have no copy constructor, cannot use auto style decls.
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+	heap_allocations++;
+	const auto p=malloc(size ? size : 1);
+	if(!p) 
+		throw bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+//
+// Print how to use this program
+//
+static void usage(const string& name)
+{
+	cerr<<"Usage: "<<name<<" [options]"<<endl;
+	cerr<<"Stamp a synthetic IR held in memory (no database), and report how long it took."<<endl;
+	cerr<<"\t--functions <n>               How many synthetic functions (1000).        "<<endl;
+	cerr<<"\t--insns <n>                   Instructions per function (16).             "<<endl;
+	cerr<<"\t--returns <n>                 Returns per function (1).                   "<<endl;
+	cerr<<"\t--calls <n>                   Direct calls per function (2).              "<<endl;
+	cerr<<"\t--tail-jump-pct <n>           Percent of functions ending in a jmp (10).  "<<endl;
+	cerr<<"\t--ib-pct <n>                  Percent of functions ending in an IB (5).   "<<endl;
+	cerr<<"\t--icfs-sets <n>               Distinct ICFS sets (16).                    "<<endl;
+	cerr<<"\t--icfs-size <n>               Targets per ICFS set (64).                  "<<endl;
+	cerr<<"\t--eh-programs <n>             Distinct shared EH programs (32).           "<<endl;
+	cerr<<"\t--seed <n>                    Random seed (1).                            "<<endl;
+	cerr<<"\t--leaf-pct <n>                Percent of functions that are frameless leaves (0)."<<endl;
+	cerr<<"\t--noreturn-pct <n>            Percent of functions that never return (0). "<<endl;
+	cerr<<"\t--stamp-value <value>         Stamp value (0x12345678).                   "<<endl;
+	cerr<<"\t--jobs <n>                    Analysis threads (1, at most one per core). "<<endl;
+	cerr<<"\t--log-level <0-2>             Transform's log level (0=summary).          "<<endl;
+	cerr<<"\t--profile <file>              Profile to choose functions to stamp.       "<<endl;
+	cerr<<"\t--skip-hottest <n>            Never stamp the <n> most sampled functions. "<<endl;
+	cerr<<"\t--min-coverage <pct>          Stamp at least <pct>% of functions.         "<<endl;
+	cerr<<"\t--overhead-budget <pct>       Predicted overhead budget, in percent.      "<<endl;
+	cerr<<"\t--counters                    Also count executions of stamp sites.       "<<endl;
+	cerr<<"\t--counters-only               Count stamp sites instead of stamping.      "<<endl;
+	cerr<<"\t--elide-safe-leaves           Skip leaves that can't write their return address."<<endl;
+	cerr<<"\t--consolidate-returns <n>     Share a stamp between <n> or more returns.  "<<endl;
+	cerr<<"\t--fde-stamp-rule              Put the EH stamp rule in each FDE, not the CIEs."<<endl;
+	cerr<<"\t--include <names|@file>       Only stamp these functions.                 "<<endl;
+	cerr<<"\t--exclude <names|@file>       Never stamp these functions.                "<<endl;
+	cerr<<"\t--address-ranges <ranges>     Only stamp functions with entries in these. "<<endl;
+	cerr<<"\t--index-ranges <ranges>       Only stamp functions at these sorted indices."<<endl;
+	cerr<<"\t--sample <pct>[:<seed>]       Only stamp about <pct>% of functions.       "<<endl;
+	cerr<<"\t--max-functions <n>           Stop after stamping <n> functions.          "<<endl;
+	cerr<<"--help,--usage,-?,-h            Display this message                        "<<endl;
+}
+
+//
+// A standalone driver for the stack stamper, built against the in-memory IRDB stand-in.
+// It generates a synthetic IR, stamps it, and reports the time taken.  The transform reports its
+// own per-phase times (feasibility, stamp, eh_update, ...), so this doubles as a microbenchmark
+// of each phase that runs in seconds on any Linux box.
+//
+int main(int argc, char* argv[])
+{
+	auto params=SynthParams_t();
+	auto stamp_value=StampValue_t(0x12345678);
+	auto jobs=size_t(1);
+	auto log_level=LogLevel_t::Summary;
+	auto use_profile=false;
+	auto profile=Profile_t();
+	auto profile_policy=ProfilePolicy_t();
+	auto count_mode=CountMode_t::None;
+	auto elide_safe_leaves=false;
+	auto consolidate_returns=size_t(0);
+	auto fde_stamp_rule=false;
+	auto use_selection=false;
+	auto selection=Selection_t();
+
+	// declare getopts values
+	const auto short_opts="f:i:r:c:t:b:S:Z:e:R:F:N:s:j:l:p:H:C:B:kKLo:Ey:x:a:d:P:m:?h";
+	struct option long_options[] = {
+		{"functions", required_argument, 0, 'f'},
+		{"insns", required_argument, 0, 'i'},
+		{"returns", required_argument, 0, 'r'},
+		{"calls", required_argument, 0, 'c'},
+		{"tail-jump-pct", required_argument, 0, 't'},
+		{"ib-pct", required_argument, 0, 'b'},
+		{"icfs-sets", required_argument, 0, 'S'},
+		{"icfs-size", required_argument, 0, 'Z'},
+		{"eh-programs", required_argument, 0, 'e'},
+		{"seed", required_argument, 0, 'R'},
+		{"leaf-pct", required_argument, 0, 'F'},
+		{"noreturn-pct", required_argument, 0, 'N'},
+		{"stamp-value", required_argument, 0, 's'},
+		{"jobs", required_argument, 0, 'j'},
+		{"log-level", required_argument, 0, 'l'},
+		{"profile", required_argument, 0, 'p'},
+		{"skip-hottest", required_argument, 0, 'H'},
+		{"min-coverage", required_argument, 0, 'C'},
+		{"overhead-budget", required_argument, 0, 'B'},
+		{"counters", no_argument, 0, 'k'},
+		{"counters-only", no_argument, 0, 'K'},
+		{"elide-safe-leaves", no_argument, 0, 'L'},
+		{"consolidate-returns", required_argument, 0, 'o'},
+		{"fde-stamp-rule", no_argument, 0, 'E'},
+		{"include", required_argument, 0, 'y'},
+		{"exclude", required_argument, 0, 'x'},
+		{"address-ranges", required_argument, 0, 'a'},
+		{"index-ranges", required_argument, 0, 'd'},
+		{"sample", required_argument, 0, 'P'},
+		{"max-functions", required_argument, 0, 'm'},
+		{"help", no_argument, 0, 'h'},
+		{"usage", no_argument, 0, '?'},
+		{0,0,0,0}
+	};
+
+	while(true)
+	{
+		auto c = getopt_long(argc, argv, short_opts, long_options, nullptr);
+		if(c == -1) break;
+		switch(c)
+		{
+			case 'f': params.functions            = strtoul(optarg,NULL,0); break;
+			case 'i': params.insns_per_function   = strtoul(optarg,NULL,0); break;
+			case 'r': params.returns_per_function = strtoul(optarg,NULL,0); break;
+			case 'c': params.calls_per_function   = strtoul(optarg,NULL,0); break;
+			case 't': params.tail_jump_pct        = strtoul(optarg,NULL,0); break;
+			case 'b': params.ib_pct               = strtoul(optarg,NULL,0); break;
+			case 'S': params.icfs_sets            = strtoul(optarg,NULL,0); break;
+			case 'Z': params.icfs_size            = strtoul(optarg,NULL,0); break;
+			case 'e': params.eh_programs          = strtoul(optarg,NULL,0); break;
+			case 'R': params.seed                 = strtoul(optarg,NULL,0); break;
+			case 'F': params.leaf_pct             = strtoul(optarg,NULL,0); break;
+			case 'N': params.noreturn_pct         = strtoul(optarg,NULL,0); break;
+			case 's': stamp_value                 = strtoul(optarg,NULL,0); break;
+			case 'j': 
+			{
+				if(!parse_count(optarg, jobs) || jobs==0)
+				{
+					cerr<<"Bad number of jobs: "<<optarg<<endl;
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			}
+			case 'l': log_level                   = (LogLevel_t)min(strtoul(optarg,NULL,0), 2ul); break;
+			case 'p': 
+			{
+				auto error=string();
+				if(!profile.load(optarg, error))
+				{
+					cerr<<error<<endl;
+					return 1;
+				}
+				use_profile=true;
+				break;
+			}
+			case 'H': 
+				if(!parse_count(optarg, profile_policy.skip_hottest))
+				{
+					cerr<<"Bad number of hottest functions to skip: "<<optarg<<endl;
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'C': 
+				if(!parse_percent(optarg, profile_policy.min_coverage_pct))
+				{
+					cerr<<"Bad coverage percentage: "<<optarg<<endl;
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'B': 
+				if(!parse_number(optarg, 0, numeric_limits<double>::max(), profile_policy.overhead_budget_pct))
+				{
+					cerr<<"Bad overhead budget: "<<optarg<<endl;
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'k': count_mode                         = CountMode_t::WithStamps; break;
+			case 'K': count_mode                         = CountMode_t::Instead;   break;
+			case 'L': elide_safe_leaves                  = true;                   break;
+			case 'o': 
+				if(!parse_count(optarg, consolidate_returns))
+				{
+					cerr<<"Bad number of returns to consolidate: "<<optarg<<endl;
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'E': fde_stamp_rule                     = true;                   break;
+			case 'y': 
+			case 'x': 
+			case 'a': 
+			case 'd': 
+			{
+				auto error=string();
+				const auto ok = 
+					c=='y' ? selection.addIncludes(optarg, error) :
+					c=='x' ? selection.addExcludes(optarg, error) :
+					c=='a' ? selection.addAddressRanges(optarg, error) :
+					         selection.addIndexRanges(optarg, error) ;
+				if(!ok)
+				{
+					cerr<<error<<endl;
+					return 1;
+				}
+				use_selection=true;
+				break;
+			}
+			case 'P': 
+			{
+				// pct[:seed]
+				const auto arg=string(optarg);
+				const auto colon=arg.find(':');
+				auto pct=0.0;
+				auto seed=uint64_t(0);
+				if(!parse_percent(arg.substr(0, colon), pct) || (colon!=string::npos && !parse_count(arg.substr(colon+1), seed)))
+				{
+					cerr<<"Bad sample: "<<optarg<<endl;
+					usage(argv[0]);
+					return 1;
+				}
+				selection.setSample(pct, seed);
+				use_selection=true;
+				break;
+			}
+			case 'm': 
+			{
+				auto max_functions=size_t(0);
+				if(!parse_count(optarg, max_functions))
+				{
+					cerr<<"Bad maximum number of functions: "<<optarg<<endl;
+					usage(argv[0]);
+					return 1;
+				}
+				selection.setMaxFunctions(max_functions);
+				use_selection=true;
+				break;
+			}
+			case '?':
+			case 'h':
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	using Clock_t = chrono::steady_clock;
+	const auto seconds=[](const Clock_t::time_point& start)
+		{ return chrono::duration<double>(Clock_t::now()-start).count(); };
+
+	// generate
+	FileIR_t::setArchitecture(64);
+	auto firp=unique_ptr<FileIR_t>(new FileIR_t("synthetic"));
+	const auto gen_start=Clock_t::now();
+	const auto funcs=SyntheticIR_t(firp.get(), params).generate();
+	const auto gen_seconds=seconds(gen_start);
+
+	// and stamp
+	const auto stamp_start=Clock_t::now();
+	const auto allocations_start=heap_allocations.load();
+	StackStamp_t ss(firp.get(), stamp_value, log_level, jobs);  // StackStamp_t has no copy constructor, cannot use auto style decls.
+	if(use_profile)
+		ss.setProfile(&profile, profile_policy);
+	ss.setCounting(count_mode);
+	ss.setElideSafeLeaves(elide_safe_leaves);
+	ss.setConsolidateReturns(consolidate_returns);
+	ss.setStampRuleInFDE(fde_stamp_rule);
+	if(use_selection)
+		ss.setSelection(&selection);
+	const auto success=ss.execute();
+	const auto stamp_seconds=seconds(stamp_start);
+	const auto allocations=heap_allocations.load()-allocations_start;
+
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::functions_generated="      << dec << funcs.size()                   << endl;
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::instructions_in_ir="       << dec << firp->getInstructions().size() << endl;
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::generate_seconds="         << fixed << gen_seconds                  << endl;
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_seconds="          << fixed << stamp_seconds                << endl;
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_us_per_function="  << fixed << stamp_seconds*1e6/max(funcs.size(), size_t(1)) << endl;
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_heap_allocations=" << dec << allocations                  << endl;
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_heap_allocations_per_function=" << fixed << (double)allocations/max(funcs.size(), size_t(1)) << endl;
+	cout << "# ATTRIBUTE Stack_Stamp_Bench::execute_succeeded="        << boolalpha << success                  << endl;
+
+	return success ? 0 : 2;
+}
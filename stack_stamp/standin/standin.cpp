@@ -0,0 +1,555 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sstream>
+#include <irdb-core>
+#include <irdb-transform>
+
+using namespace std;
+using namespace IRDB_SDK;
+
+//
+// The architecture of the IR, process-wide as in the SDK.
+//
+uint32_t FileIR_t::s_bit_width=64;
+
+//
+// How to create an (empty) FileIR_t.
+//
+FileIR_t::FileIR_t(const string& p_url)
+{
+	m_file=adopt(new File_t(p_url));
+}
+
+//
+// Take ownership of a new object, and give it the next ID.
+//
+template<class T>
+T* FileIR_t::adopt(T* obj)
+{
+	obj->setBaseID(m_next_id++);
+	m_objects.push_back(unique_ptr<BaseObj_t>(obj));
+	return obj;
+}
+
+EhProgram_t* FileIR_t::addEhProgram(Instruction_t* insn, const uint64_t caf, const int64_t daf, const uint8_t rr, const uint8_t p_ptrsize,
+                                    const EhProgramListing_t& p_cie_program, const EhProgramListing_t& p_fde_program)
+{
+	const auto eh_pgm=adopt(new EhProgram_t(caf, daf, rr, p_ptrsize, p_cie_program, p_fde_program));
+	m_eh_pgms.insert(eh_pgm);
+	if(insn)
+		insn->setEhProgram(eh_pgm);
+	return eh_pgm;
+}
+
+Instruction_t* FileIR_t::addNewInstruction(Address_t* addr, Function_t* func, const string& bits, const string& comment, AddressID_t* indTarg)
+{
+	if(addr==nullptr)
+		addr=addNewAddress(m_file->getBaseID(), 0);
+	const auto insn=adopt(new Instruction_t(addr, func, bits, comment, indTarg));
+	m_insns.insert(insn);
+	if(func)
+		func->getInstructions().insert(insn);
+	return insn;
+}
+
+Address_t* FileIR_t::addNewAddress(const DatabaseID_t& myfileID, const VirtualOffset_t& voff)
+{
+	return adopt(new Address_t(myfileID, voff));
+}
+
+Function_t* FileIR_t::addNewFunction(const string& name, Instruction_t* entry)
+{
+	const auto func=adopt(new Function_t(name, entry));
+	m_funcs.insert(func);
+	return func;
+}
+
+ICFS_t* FileIR_t::addNewICFS(Instruction_t* insn, const InstructionSet_t& targets, const ICFSAnalysisStatus_t& status)
+{
+	const auto icfs=adopt(new ICFS_t(targets, status));
+	m_icfs.insert(icfs);
+	if(insn)
+		insn->setIBTargets(icfs);
+	return icfs;
+}
+
+Relocation_t* FileIR_t::addNewRelocation(BaseObj_t* from_obj, int32_t _offset, const string& _type, BaseObj_t* WRT, int32_t addend)
+{
+	const auto reloc=adopt(new Relocation_t(_offset, _type, WRT, addend));
+	m_relocs.insert(reloc);
+
+	// attach it to what it's from, if that can have relocations.
+	if(const auto insn=dynamic_cast<Instruction_t*>(from_obj))
+		insn->getRelocations().insert(reloc);
+	else if(const auto eh_pgm=dynamic_cast<EhProgram_t*>(from_obj))
+		eh_pgm->getRelocations().insert(reloc);
+
+	return reloc;
+}
+
+DataScoop_t* FileIR_t::addNewDataScoop(const string& p_name, Address_t* p_start, Address_t* p_end, Type_t* /*p_type*/,
+                                       uint8_t p_permissions, bool p_is_relro, const string& p_contents, DatabaseID_t /*id*/)
+{
+	const auto scoop=adopt(new DataScoop_t(p_name, p_start, p_end, p_permissions, p_is_relro, p_contents));
+	m_scoops.insert(scoop);
+	return scoop;
+}
+
+//
+// Insert bits before an instruction.  The original is copied to a new instruction, and the
+// original is overwritten.  This keeps any pinned address and anything that jumps to the
+// original pointing at the new bits.
+//
+Instruction_t* Transform_t::insertDataBitsBefore(Instruction_t* before, const string& the_bits, Instruction_t* target)
+{
+	const auto after=m_firp->addNewInstruction(nullptr, before->getFunction(), before->getDataBits(), before->getComment());
+	after->setFallthrough(before->getFallthrough());
+	after->setTarget(before->getTarget());
+	after->setIBTargets(before->getIBTargets());
+	after->setEhProgram(before->getEhProgram());
+	after->setRelocations(before->getRelocations());
+
+	before->setDataBits(the_bits);
+	before->setTarget(target);
+	before->setFallthrough(after);
+	before->setIBTargets(nullptr);
+	before->setRelocations({});
+	return after;
+}
+
+Instruction_t* Transform_t::insertDataBitsAfter(Instruction_t* after, const string& the_bits, Instruction_t* target)
+{
+	const auto insn=m_firp->addNewInstruction(nullptr, after->getFunction(), the_bits);
+	insn->setFallthrough(after->getFallthrough());
+	insn->setTarget(target);
+	insn->setEhProgram(after->getEhProgram());
+	after->setFallthrough(insn);
+	return insn;
+}
+
+Instruction_t* Transform_t::addNewDataBits(const string& p_bits)
+{
+	return m_firp->addNewInstruction(nullptr, nullptr, p_bits);
+}
+
+//
+// No assembler here, see irdb-transform.
+//
+static Instruction_t* no_assembler(const string& the_asm)
+{
+	cerr << "The IRDB stand-in cannot assemble '" << the_asm << "', use the DataBits methods instead." << endl;
+	abort();
+}
+
+Instruction_t* Transform_t::insertAssemblyBefore(Instruction_t* /*before*/, const string& the_asm, Instruction_t* /*target*/)
+{
+	return no_assembler(the_asm);
+}
+
+Instruction_t* Transform_t::insertAssemblyAfter(Instruction_t* /*after*/, const string& the_asm, Instruction_t* /*target*/)
+{
+	return no_assembler(the_asm);
+}
+
+Instruction_t* Transform_t::addNewAssembly(const string& p_asm)
+{
+	return no_assembler(p_asm);
+}
+
+//
+// Register names, by size and number.
+//
+static string reg_name(uint32_t reg, uint32_t size)
+{
+	static const char* names64[16] = { "rax","rcx","rdx","rbx","rsp","rbp","rsi","rdi","r8","r9","r10","r11","r12","r13","r14","r15" };
+	static const char* names32[16] = { "eax","ecx","edx","ebx","esp","ebp","esi","edi","r8d","r9d","r10d","r11d","r12d","r13d","r14d","r15d" };
+	static const char* names16[16] = { "ax","cx","dx","bx","sp","bp","si","di","r8w","r9w","r10w","r11w","r12w","r13w","r14w","r15w" };
+	static const char* names8[16]  = { "al","cl","dl","bl","spl","bpl","sil","dil","r8b","r9b","r10b","r11b","r12b","r13b","r14b","r15b" };
+	assert(reg<16);
+	switch(size)
+	{
+		case 8:  return names64[reg];
+		case 4:  return names32[reg];
+		case 2:  return names16[reg];
+		default: return names8[reg];
+	}
+}
+
+string DecodedOperand_t::getString() const
+{
+	stringstream s; // stringstream has no copy constructor, cannot use auto style decls.
+	switch(m_kind)
+	{
+		case Register:
+			return reg_name(m_reg, m_size);
+		case Constant:
+		case Pcrel:
+			s << "0x" << hex << m_constant;
+			return s.str();
+		case Memory:
+		{
+			const char* ptr_names[9] = { "", "byte ", "word ", "", "dword ", "", "", "", "qword " };
+			const auto addr_size=FileIR_t::getArchitectureBitWidth()/8;
+			s << (m_size<=8 ? ptr_names[m_size] : "") << "[";
+			if(m_rip_relative)
+				s << "rip";
+			if(m_base>=0)
+				s << reg_name(m_base, addr_size);
+			if(m_index>=0)
+				s << "+" << reg_name(m_index, addr_size) << "*" << m_scale;
+			if(m_disp!=0 || (m_base<0 && m_index<0 && !m_rip_relative))
+				s << (m_disp<0 ? "-" : "+") << "0x" << hex << (m_disp<0 ? -m_disp : m_disp);
+			s << "]";
+			return s.str();
+		}
+	}
+	return "";
+}
+
+string Instruction_t::getDisassembly() const
+{
+	return DecodedInstruction_t::factory(this)->getDisassembly();
+}
+
+unique_ptr<DecodedInstruction_t> DecodedInstruction_t::factory(const Instruction_t* i)
+{
+	return unique_ptr<DecodedInstruction_t>(new DecodedInstruction_t(i->getDataBits()));
+}
+
+unique_ptr<DecodedOperand_t> DecodedInstruction_t::getOperand(const int op_num) const
+{
+	assert(hasOperand(op_num));
+	return unique_ptr<DecodedOperand_t>(new DecodedOperand_t(*m_operands[op_num]));
+}
+
+bool DecodedInstruction_t::setsStackPointer() const
+{
+	if(m_implicit_sp)
+		return true;
+	for(const auto &op : m_operands)
+		if(op->isRegister() && op->isWritten() && op->getRegNumber()==4)
+			return true;
+	return false;
+}
+
+string DecodedInstruction_t::getDisassembly() const
+{
+	if(!m_valid)
+		return "(bad)";
+	auto s=m_mnemonic;
+	for(auto i=size_t(0); i<m_operands.size(); i++)
+		s += (i==0 ? " " : ", ") + m_operands[i]->getString();
+	return s;
+}
+
+//
+// Decode the bits.  Only the common integer subset of x86 is handled, see irdb-core.
+//
+DecodedInstruction_t::DecodedInstruction_t(const string& bits)
+{
+	static const char* alu_names[8] = { "add","or","adc","sbb","and","sub","xor","cmp" };
+	static const char* cc_names[16] = { "o","no","b","ae","e","ne","be","a","s","ns","p","np","l","ge","le","g" };
+
+	const auto bits64=FileIR_t::getArchitectureBitWidth()==64;
+	const auto byte=[&](size_t pos) { return (uint8_t)bits[pos]; };
+	auto pos=size_t(0);
+	auto ok=true;
+
+	// legacy prefixes
+	auto opsize16=false;
+	while(pos<bits.size())
+	{
+		const auto b=byte(pos);
+		if(b==0x66)
+			opsize16=true;
+		else if(b!=0xf0 && b!=0xf2 && b!=0xf3 && b!=0x2e && b!=0x36 && b!=0x3e && b!=0x26 && b!=0x64 && b!=0x65 && b!=0x67)
+			break;
+		pos++;
+	}
+
+	// REX
+	auto rex=uint8_t(0);
+	if(bits64 && pos<bits.size() && (byte(pos) & 0xf0)==0x40)
+		rex=byte(pos++);
+	const auto rex_w=(rex & 8)!=0;
+	const auto rex_r=(rex & 4) ? 8u : 0u;
+	const auto rex_x=(rex & 2) ? 8u : 0u;
+	const auto rex_b=(rex & 1) ? 8u : 0u;
+	const auto opsize=rex_w ? 8u : opsize16 ? 2u : 4u;
+	const auto stack_size=bits64 ? 8u : 4u;
+
+	// opcode
+	if(pos>=bits.size()) return;
+	auto op=byte(pos++);
+	const auto two_byte=(op==0x0f);
+	if(two_byte)
+	{
+		if(pos>=bits.size()) return;
+		op=byte(pos++);
+	}
+
+	// read a little-endian, sign-extended immediate
+	const auto imm=[&](size_t size) -> int64_t
+		{
+			if(pos+size>bits.size()) { ok=false; return 0; }
+			auto value=uint64_t(0);
+			for(auto i=size_t(0); i<size; i++)
+				value |= uint64_t(byte(pos+i)) << (8*i);
+			pos+=size;
+			if(size<8 && (value >> (8*size-1)) & 1)
+				value |= ~uint64_t(0) << (8*size);
+			return (int64_t)value;
+		};
+
+	// operand builders
+	const auto reg_op=[&](uint32_t reg, uint32_t size, bool read, bool written)
+		{
+			auto o=make_shared<DecodedOperand_t>(DecodedOperand_t::Register, size);
+			o->m_reg=reg; o->m_read=read; o->m_written=written;
+			m_operands.push_back(o);
+		};
+	const auto imm_op=[&](size_t imm_size, uint32_t size)
+		{
+			auto o=make_shared<DecodedOperand_t>(DecodedOperand_t::Constant, size);
+			m_immediate=imm(imm_size);
+			o->m_constant=(uint64_t)m_immediate; o->m_read=true;
+			m_operands.push_back(o);
+		};
+	const auto rel_op=[&](size_t imm_size)
+		{
+			auto o=make_shared<DecodedOperand_t>(DecodedOperand_t::Pcrel, stack_size);
+			m_immediate=imm(imm_size);
+			o->m_constant=(uint64_t)m_immediate; o->m_read=true;
+			m_operands.push_back(o);
+		};
+
+	// decode a ModRM (and SIB and displacement), returning the reg field and building the r/m operand
+	const auto modrm=[&](uint32_t size, bool read, bool written) -> uint32_t
+		{
+			if(pos>=bits.size()) { ok=false; return 0; }
+			const auto m=byte(pos++);
+			const auto mod=m>>6;
+			const auto reg=((m>>3)&7) | rex_r;
+			const auto rm=m&7;
+			if(mod==3)
+			{
+				reg_op(rm|rex_b, size, read, written);
+				return reg;
+			}
+
+			auto o=make_shared<DecodedOperand_t>(DecodedOperand_t::Memory, size);
+			o->m_read=read; o->m_written=written;
+			if(rm==4)
+			{
+				if(pos>=bits.size()) { ok=false; return 0; }
+				const auto sib=byte(pos++);
+				const auto base=sib&7;
+				const auto index=((sib>>3)&7) | rex_x;
+				o->m_scale=1u << (sib>>6);
+				if(index!=4)
+					o->m_index=index;
+				if(base==5 && mod==0)
+					o->m_disp=imm(4);
+				else
+					o->m_base=base|rex_b;
+			}
+			else if(rm==5 && mod==0)
+			{
+				o->m_rip_relative=bits64;
+				o->m_disp=imm(4);
+			}
+			else
+			{
+				o->m_base=rm|rex_b;
+			}
+			if(mod==1) o->m_disp=imm(1);
+			if(mod==2) o->m_disp=imm(4);
+			m_operands.push_back(o);
+			return reg;
+		};
+
+	// the size of an ALU-style immediate for the operand size
+	const auto imm_size=(opsize==2) ? size_t(2) : size_t(4);
+
+	if(!two_byte && op<0x40 && (op&7)<6)
+	{
+		// add/or/adc/sbb/and/sub/xor/cmp in all six forms
+		const auto alu=op>>3;
+		const auto is_cmp=(alu==7);
+		const auto size=(op&1) ? opsize : 1u;
+		m_mnemonic=alu_names[alu];
+		switch(op&7)
+		{
+			case 0: case 1: { const auto r=modrm(size, true, !is_cmp); reg_op(r, size, true, false); break; }
+			case 2: case 3:
+			{
+				// reg is the destination, so comes first
+				const auto r=modrm(size, true, false);
+				const auto src=m_operands.back();
+				m_operands.pop_back();
+				reg_op(r, size, true, !is_cmp);
+				m_operands.push_back(src);
+				break;
+			}
+			case 4: reg_op(0, 1, true, !is_cmp); imm_op(1, 1); break;
+			case 5: reg_op(0, opsize, true, !is_cmp); imm_op(imm_size, opsize); break;
+		}
+	}
+	else if(!two_byte && op>=0x50 && op<=0x57)
+	{
+		m_mnemonic="push"; m_implicit_sp=true;
+		reg_op((op&7)|rex_b, stack_size, true, false);
+	}
+	else if(!two_byte && op>=0x58 && op<=0x5f)
+	{
+		m_mnemonic="pop"; m_implicit_sp=true;
+		reg_op((op&7)|rex_b, stack_size, false, true);
+	}
+	else if(!two_byte && (op==0x68 || op==0x6a))
+	{
+		m_mnemonic="push"; m_implicit_sp=true;
+		imm_op(op==0x68 ? 4 : 1, stack_size);
+	}
+	else if(!two_byte && op>=0x70 && op<=0x7f)
+	{
+		m_mnemonic=string("j")+cc_names[op&0xf]; m_is_branch=true; m_is_conditional=true;
+		rel_op(1);
+	}
+	else if(two_byte && op>=0x80 && op<=0x8f)
+	{
+		m_mnemonic=string("j")+cc_names[op&0xf]; m_is_branch=true; m_is_conditional=true;
+		rel_op(4);
+	}
+	else if(!two_byte && (op==0x80 || op==0x81 || op==0x83))
+	{
+		const auto size=(op==0x80) ? 1u : opsize;
+		const auto alu=((pos<bits.size() ? byte(pos) : 0)>>3)&7;
+		m_mnemonic=alu_names[alu];
+		modrm(size, true, alu!=7);
+		imm_op(op==0x81 ? imm_size : 1, size);
+	}
+	else if(!two_byte && (op==0x84 || op==0x85))
+	{
+		const auto size=(op&1) ? opsize : 1u;
+		m_mnemonic="test";
+		const auto r=modrm(size, true, false);
+		reg_op(r, size, true, false);
+	}
+	else if(!two_byte && (op==0x88 || op==0x89))
+	{
+		const auto size=(op&1) ? opsize : 1u;
+		m_mnemonic="mov";
+		const auto r=modrm(size, false, true);
+		reg_op(r, size, true, false);
+	}
+	else if(!two_byte && (op==0x8a || op==0x8b || op==0x8d))
+	{
+		const auto size=(op==0x8a) ? 1u : opsize;
+		m_mnemonic=(op==0x8d) ? "lea" : "mov";
+		const auto r=modrm(size, op!=0x8d, false);
+		const auto src=m_operands.back();
+		m_operands.pop_back();
+		reg_op(r, size, false, true);
+		m_operands.push_back(src);
+	}
+	else if(!two_byte && op==0x90)
+	{
+		m_mnemonic="nop";
+	}
+	else if(!two_byte && op>=0xb8 && op<=0xbf)
+	{
+		m_mnemonic="mov";
+		reg_op((op&7)|rex_b, opsize, false, true);
+		imm_op(rex_w ? 8 : imm_size, opsize);
+	}
+	else if(!two_byte && (op==0xc2 || op==0xc3))
+	{
+		m_mnemonic="ret"; m_is_return=true; m_is_branch=true; m_implicit_sp=true;
+		if(op==0xc2)
+			imm_op(2, 2);
+	}
+	else if(!two_byte && (op==0xc6 || op==0xc7))
+	{
+		const auto size=(op==0xc6) ? 1u : opsize;
+		m_mnemonic="mov";
+		modrm(size, false, true);
+		imm_op(op==0xc6 ? 1 : imm_size, size);
+	}
+	else if(!two_byte && op==0xc9)
+	{
+		m_mnemonic="leave"; m_implicit_sp=true;
+	}
+	else if(!two_byte && op==0xcc)
+	{
+		m_mnemonic="int3";
+	}
+	else if(!two_byte && op==0xe8)
+	{
+		m_mnemonic="call"; m_is_call=true; m_is_branch=true; m_implicit_sp=true;
+		rel_op(4);
+	}
+	else if(!two_byte && (op==0xe9 || op==0xeb))
+	{
+		m_mnemonic="jmp"; m_is_branch=true;
+		rel_op(op==0xe9 ? 4 : 1);
+	}
+	else if(!two_byte && op==0xf4)
+	{
+		m_mnemonic="hlt";
+	}
+	else if(!two_byte && op==0xff)
+	{
+		const auto ext=((pos<bits.size() ? byte(pos) : 0)>>3)&7;
+		switch(ext)
+		{
+			case 0: m_mnemonic="inc"; modrm(opsize, true, true); break;
+			case 1: m_mnemonic="dec"; modrm(opsize, true, true); break;
+			case 2: m_mnemonic="call"; m_is_call=true; m_is_branch=true; m_implicit_sp=true; modrm(stack_size, true, false); break;
+			case 4: m_mnemonic="jmp"; m_is_branch=true; modrm(stack_size, true, false); break;
+			case 6: m_mnemonic="push"; m_implicit_sp=true; modrm(stack_size, true, false); break;
+			default: ok=false; break;
+		}
+	}
+	else if(two_byte && op==0x05)
+	{
+		m_mnemonic="syscall";
+	}
+	else if(two_byte && op==0x0b)
+	{
+		m_mnemonic="ud2";
+	}
+	else if(two_byte && op==0x1f)
+	{
+		m_mnemonic="nop";
+		modrm(opsize, false, false);
+	}
+	else
+	{
+		ok=false;
+	}
+
+	m_valid=ok && pos<=bits.size();
+	m_length=(uint32_t)pos;
+	if(!m_valid)
+	{
+		m_mnemonic="(bad)";
+		m_operands.clear();
+		m_is_branch=m_is_call=m_is_return=m_is_conditional=m_implicit_sp=false;
+	}
+}
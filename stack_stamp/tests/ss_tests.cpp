@@ -0,0 +1,788 @@
+/*
+   Copyright 2017-2019 University of Virginia
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <string.h>
+#include <stddef.h>
+#include <algorithm>
+#include <functional>
+#include <sstream>
+#include <irdb-core>
+#include "ss.hpp"
+
+using namespace std;
+using namespace IRDB_SDK;
+using namespace Stamper;
+
+#define ALLOF(a) begin(a), end(a)
+
+//
+// Unit tests for the stamper, run against the in-memory IRDB stand-in (see standin/).  Each test
+// builds a small IR by hand, stamps it, and checks the result.  Exits non-zero if any test fails.
+//
+
+#define CHECK(cond) \
+	do { if(!(cond)) { cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << endl; return false; } } while(0)
+
+// the x86-64 machine code the tests are built from
+static const auto push_rbp    = string("\x55", 1);                      // push rbp
+static const auto push_rsp    = string("\x54", 1);                      // push rsp
+static const auto pop_rax     = string("\x58", 1);                      // pop rax
+static const auto pop_rbp     = string("\x5d", 1);                      // pop rbp
+static const auto mov_rbp_rsp = string("\x48\x89\xe5", 3);              // mov rbp, rsp
+static const auto mov_rbp_rax = string("\x48\x89\xc5", 3);              // mov rbp, rax
+static const auto mov_eax_ebx = string("\x89\xd8", 2);                  // mov eax, ebx
+static const auto lea_rax_rsp = string("\x48\x8d\x04\x24", 4);          // lea rax, [rsp]
+static const auto mov_rbp_m8  = string("\x89\x45\xf8", 3);              // mov [rbp-0x8], eax
+static const auto je_rel32    = string("\x0f\x84\x00\x00\x00\x00", 6);  // je <target>
+static const auto jmp_rel32   = string("\xe9\x00\x00\x00\x00", 5);      // jmp <target>
+static const auto call_rel32  = string("\xe8\x00\x00\x00\x00", 5);      // call <target>
+static const auto jmp_rax     = string("\xff\xe0", 2);                  // jmp rax
+static const auto ret         = string("\xc3", 1);                      // ret
+
+static const auto stamp_value = StampValue_t(0x12345678);
+
+//
+// A small IR to stamp, built a function at a time.
+//
+class TestIR_t
+{
+	public:
+		TestIR_t() : m_firp(new FileIR_t("test")) { }
+
+		FileIR_t* getFileIR() const { return m_firp.get(); }
+
+		// add a function made of the given instructions, each falling through to the next (except 
+		// after a return).  The instructions are returned in insns, if given.
+		Function_t* addFunction(const string& name, const vector<string>& bits, vector<Instruction_t*>* insns=nullptr)
+		{
+			auto f=(Function_t*)nullptr;
+			auto prev=(Instruction_t*)nullptr;
+			auto all=InstructionSet_t();
+			for(const auto &b : bits)
+			{
+				const auto addr=m_firp->addNewAddress(m_firp->getFile()->getBaseID(), m_next_addr);
+				m_next_addr+=b.size();
+				const auto insn=m_firp->addNewInstruction(addr, f, b, "test");
+				if(f==nullptr)
+					f=m_firp->addNewFunction(name, insn);
+				insn->setFunction(f);
+				if(prev && prev->getDataBits()!=ret)
+					prev->setFallthrough(insn);
+				prev=insn;
+				all.insert(insn);
+				if(insns)
+					insns->push_back(insn);
+			}
+			f->setInstructions(all);
+			return f;
+		}
+
+		// stamp the IR, after letting configure set any options.  Returns what the transform logged.
+		string stamp(const function<void(StackStamp_t&)>& configure=nullptr)
+		{
+			stringstream log; // stringstream has no copy constructor, cannot use auto style decls.
+			const auto old_buf=cout.rdbuf(log.rdbuf());
+			{
+				StackStamp_t ss(m_firp.get(), stamp_value, LogLevel_t::Site);  // StackStamp_t has no copy constructor, cannot use auto style decls.
+				if(configure)
+					configure(ss);
+				m_success=ss.execute();
+			}
+			cout.rdbuf(old_buf);
+			return log.str();
+		}
+
+		bool succeeded() const { return m_success; }
+
+	private:
+		unique_ptr<FileIR_t> m_firp;
+		VirtualOffset_t m_next_addr = 0x400000;
+		bool m_success              = false;
+};
+
+//
+// Is the instruction a stamp (xor [rsp], imm)?
+//
+static bool is_stamp(const Instruction_t* insn)
+{
+	const auto &bits=insn->getDataBits();
+	return bits.size()>=4 && ((uint8_t)bits[0]==0x81 || (uint8_t)bits[0]==0x83) && bits.substr(1,2)=="\x34\x24";
+}
+
+//
+// Was the function stamped?  Stamping puts the stamp in the entry instruction (the original moves after it).
+//
+static bool is_stamped(const Function_t* f)
+{
+	return is_stamp(f->getEntryPoint());
+}
+
+//
+// The basics:  the entry and each return of a framed function are stamped.
+//
+static bool test_stamps_entry_and_returns()
+{
+	auto ir=TestIR_t();
+	auto insns=vector<Instruction_t*>();
+	const auto f=ir.addFunction("f", {push_rbp, mov_rbp_rsp, je_rel32, pop_rbp, ret, pop_rbp, ret}, &insns);
+	insns[2]->setTarget(insns[5]);
+
+	ir.stamp();
+	CHECK(ir.succeeded());
+	CHECK(is_stamped(f));
+
+	// each return is now a stamp, followed by the return
+	for(const auto r : {insns[4], insns[6]})
+	{
+		CHECK(is_stamp(r));
+		CHECK(r->getFallthrough()!=nullptr && r->getFallthrough()->getDataBits()==ret);
+	}
+	return true;
+}
+
+//
+// Functions that never return (see StackStamp_t::never_returns) end with a call that doesn't come back.  
+// They get no stamps, and their EH program is left as it is.
+//
+static bool test_never_returns_is_skipped()
+{
+	auto ir=TestIR_t();
+	auto insns=vector<Instruction_t*>();
+	const auto f=ir.addFunction("fatal", {push_rbp, mov_rbp_rsp, mov_eax_ebx, call_rel32}, &insns);
+	const auto h=ir.addFunction("abort", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret});
+	insns[3]->setTarget(h->getEntryPoint());
+
+	const auto cie=EhProgramListing_t({"cie"});
+	const auto pgm=ir.getFileIR()->addEhProgram(nullptr, 1, -8, 16, 8, cie, {"fde"});
+	for(const auto insn : insns)
+		insn->setEhProgram(pgm);
+
+	const auto log=ir.stamp();
+	CHECK(ir.succeeded());
+	CHECK(log.find("Functions_Never_Return_Skipped=1\n")!=string::npos);
+
+	// no entry stamp, no stamp anywhere else, and the program wasn't copied or changed.
+	CHECK(!is_stamped(f));
+	CHECK(f->getInstructions().size()==insns.size());
+	CHECK(none_of(ALLOF(insns), is_stamp));
+	CHECK(all_of(ALLOF(insns), [&](const Instruction_t* insn) { return insn->getEhProgram()==pgm; }));
+	CHECK(ir.getFileIR()->getAllEhPrograms()==EhProgramSet_t({pgm}));
+	CHECK(pgm->getCIEProgram()==cie);
+	return true;
+}
+
+// A function with such a call on one path, but a return on another, is stamped as usual.
+static bool test_returns_on_some_path_is_stamped()
+{
+	auto ir=TestIR_t();
+	auto insns=vector<Instruction_t*>();
+	const auto f=ir.addFunction("maybe_fatal", {push_rbp, mov_rbp_rsp, je_rel32, call_rel32, pop_rbp, ret}, &insns);
+	const auto h=ir.addFunction("abort", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret});
+	insns[2]->setTarget(insns[4]);
+	insns[3]->setTarget(h->getEntryPoint());
+	insns[3]->setFallthrough(nullptr);
+
+	const auto log=ir.stamp();
+	CHECK(ir.succeeded());
+	CHECK(log.find("Functions_Never_Return_Skipped=0\n")!=string::npos);
+	CHECK(is_stamped(f));
+	CHECK(is_stamp(insns[5]));
+	return true;
+}
+
+//
+// Safe leaf elision (see StackStamp_t::is_safe_leaf):  stamp a function with --elide-safe-leaves and 
+// report whether it was left alone as a safe leaf.  The function is padded (before its last instruction) 
+// so that it's big enough to stamp at all.
+//
+static bool elided_as_safe_leaf(vector<string> bits)
+{
+	bits.insert(prev(bits.end()), 3, mov_eax_ebx);
+	auto ir=TestIR_t();
+	const auto f=ir.addFunction("leaf", bits);
+	const auto log=ir.stamp([](StackStamp_t& ss) { ss.setElideSafeLeaves(true); });
+	return !is_stamped(f) && log.find("Functions_Safe_Leaves_Skipped=1")!=string::npos;
+}
+
+static bool test_safe_leaf_plain()
+{
+	CHECK(elided_as_safe_leaf({mov_eax_ebx, ret}));
+	return true;
+}
+
+// push rsp; pop rax leaves a stack address in rax, which a later write could use.
+static bool test_safe_leaf_push_rsp()
+{
+	CHECK(!elided_as_safe_leaf({push_rsp, pop_rax, ret}));
+	return true;
+}
+
+// lea takes a stack address.
+static bool test_safe_leaf_lea_rsp()
+{
+	CHECK(!elided_as_safe_leaf({lea_rax_rsp, ret}));
+	return true;
+}
+
+// a write through rbp might be a write to the frame.
+static bool test_safe_leaf_write_via_rbp()
+{
+	CHECK(!elided_as_safe_leaf({mov_rbp_m8, ret}));
+	return true;
+}
+
+// saving and restoring the caller's rbp is fine ...
+static bool test_safe_leaf_balanced_push_rbp()
+{
+	CHECK(elided_as_safe_leaf({push_rbp, mov_eax_ebx, pop_rbp, ret}));
+	return true;
+}
+
+// ... but not pushing rbp after it's been written.
+static bool test_safe_leaf_push_rbp_after_write()
+{
+	CHECK(!elided_as_safe_leaf({mov_eax_ebx, mov_rbp_rax, push_rbp, pop_rbp, ret}));
+	return true;
+}
+
+//
+// Return consolidation (see StackStamp_t::consolidate_returns):  with three returns, one is 
+// stamped and the others become direct jumps to it, without the returns' indirect targets.
+//
+static bool test_consolidated_returns_are_plain_jumps()
+{
+	auto ir=TestIR_t();
+	auto insns=vector<Instruction_t*>();
+	ir.addFunction("f", {push_rbp, mov_rbp_rsp, je_rel32, je_rel32, pop_rbp, ret, pop_rbp, ret, pop_rbp, ret}, &insns);
+	insns[2]->setTarget(insns[6]);
+	insns[3]->setTarget(insns[8]);
+
+	// returns have the return sites as their ICFS
+	const auto return_sites=ir.getFileIR()->addNewICFS(nullptr, {}, iasAnalysisComplete);
+	const auto returns=vector<Instruction_t*>({insns[5], insns[7], insns[9]});
+	for(const auto r : returns)
+		r->setIBTargets(return_sites);
+
+	const auto log=ir.stamp([](StackStamp_t& ss) { ss.setConsolidateReturns(2); });
+	CHECK(log.find("returns_consolidated=3")!=string::npos);
+
+	// one is the shared stamp, followed by the return (which keeps its ICFS) ...
+	CHECK(count_if(ALLOF(returns), is_stamp)==1);
+	const auto shared=*find_if(ALLOF(returns), is_stamp);
+	CHECK(shared->getFallthrough()!=nullptr && shared->getFallthrough()->getDataBits()==ret);
+	CHECK(shared->getFallthrough()->getIBTargets()==return_sites);
+
+	// ... and the others jump to it
+	for(const auto r : returns)
+	{
+		if(r==shared)
+			continue;
+		CHECK(r->getDataBits()==jmp_rel32);
+		CHECK(r->getTarget()==shared);
+		CHECK(r->getIBTargets()==nullptr);
+	}
+	return true;
+}
+
+//
+// Tail jump fusion (see StackStamp_t::fuse_tail_jumps):  f ends with a tail jump to g.  Stamp them (excluding 
+// any named in exclude), and return f's instructions as they were built.
+//
+static bool stamp_tail_jump(const string& exclude, Function_t*& g, vector<Instruction_t*>& f_insns, string& log, TestIR_t& ir)
+{
+	ir.addFunction("f", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, jmp_rel32}, &f_insns);
+	g=ir.addFunction("g", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret});
+	f_insns[4]->setTarget(g->getEntryPoint());
+
+	auto selection=Selection_t();
+	auto error=string();
+	CHECK(exclude.empty() || selection.addExcludes(exclude, error));
+	log=ir.stamp([&](StackStamp_t& ss)
+		{
+			if(!exclude.empty())
+				ss.setSelection(&selection);
+		});
+	CHECK(ir.succeeded());
+	return true;
+}
+
+// When g is stamped, f's jump skips g's entry stamp, and f doesn't unstamp before it.
+static bool test_tail_jump_fused_with_stamped_target()
+{
+	auto ir=TestIR_t();
+	auto g=(Function_t*)nullptr;
+	auto f_insns=vector<Instruction_t*>();
+	auto log=string();
+	CHECK(stamp_tail_jump("", g, f_insns, log, ir));
+	CHECK(log.find("tail_jumps_fused=1\n")!=string::npos);
+
+	// g's entry is its stamp, followed by the original entry, which is where f now jumps.
+	CHECK(is_stamped(g));
+	const auto post_stamp=g->getEntryPoint()->getFallthrough();
+	CHECK(post_stamp!=nullptr && post_stamp->getDataBits()==push_rbp);
+
+	// the jump is still the jump (a stamp would have taken its place), right after the pop.
+	const auto jump=f_insns[4];
+	CHECK(jump->getDataBits()==jmp_rel32);
+	CHECK(jump->getTarget()==post_stamp);
+	CHECK(f_insns[3]->getFallthrough()==jump);
+	return true;
+}
+
+// When g isn't stamped, f's jump is stamped as usual and still goes to g's entry.
+static bool test_tail_jump_to_unstamped_target_is_stamped()
+{
+	auto ir=TestIR_t();
+	auto g=(Function_t*)nullptr;
+	auto f_insns=vector<Instruction_t*>();
+	auto log=string();
+	CHECK(stamp_tail_jump("g", g, f_insns, log, ir));
+	CHECK(log.find("tail_jumps_fused=0\n")!=string::npos);
+
+	CHECK(!is_stamped(g));
+	const auto stamp=f_insns[4];
+	CHECK(is_stamp(stamp));
+	const auto jump=stamp->getFallthrough();
+	CHECK(jump!=nullptr && jump->getDataBits()==jmp_rel32);
+	CHECK(jump->getTarget()==g->getEntryPoint());
+	return true;
+}
+
+//
+// Indirect branches (see StackStamp_t::classify_ib):  whether an IB leaves its function, stays, or might 
+// do either, decided from a summary of its ICFS, must be what scanning the ICFS at each IB decides.
+//
+// The scan, for reference.
+static ExitKind_t scan_icfs(const ICFS_t* icfs, const Function_t* f)
+{
+	const auto leaver=find_if(ALLOF(*icfs), [&](Instruction_t* target) { return target->getFunction()!=f; });
+	const auto stayer=find_if(ALLOF(*icfs), [&](Instruction_t* target) { return target->getFunction()==f; });
+	const auto might_leave=leaver!=icfs->end();
+	const auto might_stay=stayer!=icfs->end();
+	return !might_leave ? ExitKind_t::IBStay : !might_stay ? ExitKind_t::IBExit : ExitKind_t::IBMixed;
+}
+
+static bool test_ib_verdicts_match_icfs_scan()
+{
+	auto ir=TestIR_t();
+	const auto firp=ir.getFileIR();
+	const auto h=ir.addFunction("h", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret});
+
+	// each function has an IB (with no fallthrough) on one path and a return on the other.
+	struct IB_t { Function_t* f; Instruction_t* ib; Instruction_t* inside; };
+	const auto add_ib_function=[&](const string& name)
+		{
+			auto insns=vector<Instruction_t*>();
+			const auto f=ir.addFunction(name, {push_rbp, mov_rbp_rsp, je_rel32, jmp_rax, pop_rbp, ret}, &insns);
+			insns[2]->setTarget(insns[4]);
+			insns[3]->setFallthrough(nullptr);
+			return IB_t({f, insns[3], insns[4]});
+		};
+	const auto stays =add_ib_function("stays");
+	const auto leaves=add_ib_function("leaves");
+	const auto mixed =add_ib_function("mixed");
+	const auto shares_stays=add_ib_function("shares_stays");
+	const auto shares_mixed=add_ib_function("shares_mixed");
+
+	// ICFS sets, some of them shared between functions.
+	const auto stays_icfs =firp->addNewICFS(nullptr, {stays.inside}, iasAnalysisComplete);
+	const auto leaves_icfs=firp->addNewICFS(nullptr, {h->getEntryPoint()}, iasAnalysisComplete);
+	const auto mixed_icfs =firp->addNewICFS(nullptr, {mixed.inside, h->getEntryPoint()}, iasAnalysisComplete);
+	const auto ibs=vector<pair<IB_t, ICFS_t*> >(
+		{
+			{stays,        stays_icfs},
+			{leaves,       leaves_icfs},
+			{mixed,        mixed_icfs},
+			{shares_stays, stays_icfs},
+			{shares_mixed, mixed_icfs},
+		});
+	auto expected=vector<ExitKind_t>();
+	for(const auto &ib : ibs)
+	{
+		ib.first.ib->setIBTargets(ib.second);
+		expected.push_back(scan_icfs(ib.second, ib.first.f));
+	}
+	CHECK(expected==vector<ExitKind_t>({ExitKind_t::IBStay, ExitKind_t::IBExit, ExitKind_t::IBMixed, ExitKind_t::IBExit, ExitKind_t::IBExit}));
+
+	ir.stamp();
+	CHECK(ir.succeeded());
+
+	// what the stamper decided:  not stamping the function at all (mixed), or stamping the IB (leaves) or not (stays).
+	for(auto i=0u; i<ibs.size(); i++)
+	{
+		const auto &ib=ibs[i].first;
+		const auto verdict=!is_stamped(ib.f) ? ExitKind_t::IBMixed : is_stamp(ib.ib) ? ExitKind_t::IBExit : ExitKind_t::IBStay;
+		CHECK(verdict==expected[i]);
+	}
+	return true;
+}
+
+//
+// Fixed calls (see StackStamp_t::index_fixed_calls):  a jump marked with a "fix_call_fallthrough" relocation 
+// is a call, not a tail jump, so it's neither stamped nor fused with its target's entry stamp.
+//
+static bool test_fixed_call_is_not_a_tail_jump()
+{
+	auto ir=TestIR_t();
+	const auto firp=ir.getFileIR();
+	auto insns=vector<Instruction_t*>();
+	const auto f=ir.addFunction("f", {push_rbp, mov_rbp_rsp, je_rel32, jmp_rel32, pop_rbp, ret}, &insns);
+	const auto h=ir.addFunction("h", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret});
+	insns[2]->setTarget(insns[4]);
+	insns[3]->setTarget(h->getEntryPoint());
+	insns[3]->setFallthrough(nullptr);
+
+	// the jump has other relocations too.
+	firp->addNewRelocation(insns[3], 1, "pcrel");
+	firp->addNewRelocation(insns[3], 0, "fix_call_fallthrough");
+
+	const auto log=ir.stamp();
+	CHECK(ir.succeeded());
+	CHECK(log.find("tail_jumps_fused=0\n")!=string::npos);
+	CHECK(log.find("tail_jumps_stamped=0\n")!=string::npos);
+	CHECK(is_stamped(f));
+	CHECK(is_stamped(h));
+	CHECK(insns[3]->getDataBits()==jmp_rel32);
+	CHECK(insns[3]->getTarget()==h->getEntryPoint());
+	return true;
+}
+
+//
+// Stamp site counters (see StackStamp_t::count and finish_counter_scoop).  The scoop's layout, as 
+// counters/ss_counters.c reads it:
+//
+struct CounterHeader_t
+{
+	char     magic[16];
+	uint64_t sites;
+};
+
+struct CounterSite_t
+{
+	uint64_t address;
+	uint64_t count;
+};
+
+// With counting on, each site's stamp is preceded by an increment of its slot in the counter scoop.
+static bool test_counter_precedes_stamp()
+{
+	auto ir=TestIR_t();
+	auto insns=vector<Instruction_t*>();
+	ir.addFunction("f", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret}, &insns);
+	const auto entry_addr=insns[0]->getAddress()->getVirtualOffset();
+	const auto ret_addr=insns[4]->getAddress()->getVirtualOffset();
+
+	const auto log=ir.stamp([](StackStamp_t& ss) { ss.setCounting(CountMode_t::WithStamps); });
+	CHECK(ir.succeeded());
+	CHECK(log.find("counted_sites=2\n")!=string::npos);
+
+	const auto &scoops=ir.getFileIR()->getDataScoops();
+	const auto scoop_it=find_if(ALLOF(scoops), [](const DataScoop_t* s) { return s->getName()=="stack_stamp_counters"; });
+	CHECK(scoop_it!=scoops.end());
+	const auto scoop=*scoop_it;
+
+	// the header and one slot per site:  the return, then the entry.
+	const auto &contents=scoop->getContents();
+	CHECK(contents.size()==sizeof(CounterHeader_t) + 2*sizeof(CounterSite_t));
+	CHECK(scoop->getEnd()->getVirtualOffset()-scoop->getStart()->getVirtualOffset()+1==contents.size());
+	CHECK((scoop->getStart()->getVirtualOffset() & 0xfff)==0);
+	auto header=CounterHeader_t();
+	auto sites=vector<CounterSite_t>(2);
+	memcpy(&header, contents.data(), sizeof(header));
+	memcpy(sites.data(), contents.data()+sizeof(header), 2*sizeof(CounterSite_t));
+	CHECK(memcmp(header.magic, "SS_COUNTERS_V1\0\0", sizeof(header.magic))==0);
+	CHECK(header.sites==2);
+	CHECK(sites[0].address==ret_addr && sites[0].count==0);
+	CHECK(sites[1].address==entry_addr && sites[1].count==0);
+
+	// each site is now inc qword [rip+slot], the stamp, and the original instruction.
+	const auto counted=vector<pair<Instruction_t*, size_t> >({{insns[4], 0}, {insns[0], 1}});
+	for(const auto &site : counted)
+	{
+		const auto inc=site.first;
+		const auto &bits=inc->getDataBits();
+		CHECK(bits.size()==7 && bits.substr(0,3)==string("\x48\xff\x05", 3));
+		auto disp=uint32_t(0);
+		memcpy(&disp, bits.data()+3, sizeof(disp));
+		CHECK(disp==sizeof(CounterHeader_t) + site.second*sizeof(CounterSite_t) + offsetof(CounterSite_t, count));
+
+		// the rewriter makes the displacement relative to the scoop
+		const auto &relocs=inc->getRelocations();
+		CHECK(relocs.size()==1);
+		const auto reloc=*relocs.begin();
+		CHECK(reloc->getType()=="pcrel" && reloc->getWRT()==scoop && reloc->getOffset()==0 && reloc->getAddend()==0);
+
+		const auto stamp=inc->getFallthrough();
+		CHECK(stamp!=nullptr && is_stamp(stamp));
+		CHECK(stamp->getFallthrough()!=nullptr);
+	}
+	CHECK(insns[0]->getFallthrough()->getFallthrough()->getDataBits()==push_rbp);
+	CHECK(insns[4]->getFallthrough()->getFallthrough()->getDataBits()==ret);
+	return true;
+}
+
+//
+// EH program cleanup (see StackStamp_t::cleanup_eh_pgms):  programs that no instruction uses afterwards 
+// are dropped, including any that no instruction used in the input.  Those still in use are kept.
+//
+static bool test_unused_eh_programs_are_dropped()
+{
+	auto ir=TestIR_t();
+	const auto firp=ir.getFileIR();
+	auto stamped_insns=vector<Instruction_t*>();
+	auto excluded_insns=vector<Instruction_t*>();
+	ir.addFunction("stamped",  {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret}, &stamped_insns);
+	ir.addFunction("excluded", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret}, &excluded_insns);
+
+	// stamped's program gets the rule, excluded's is still used, and unused was never used.
+	const auto stamped_pgm =firp->addEhProgram(nullptr, 1, -8, 16, 8, {"cie"}, {"stamped"});
+	const auto excluded_pgm=firp->addEhProgram(nullptr, 1, -8, 16, 8, {"cie"}, {"excluded"});
+	const auto unused_pgm  =firp->addEhProgram(nullptr, 1, -8, 16, 8, {"cie"}, {"unused"});
+	for(const auto insn : stamped_insns)
+		insn->setEhProgram(stamped_pgm);
+	for(const auto insn : excluded_insns)
+		insn->setEhProgram(excluded_pgm);
+
+	auto selection=Selection_t();
+	auto error=string();
+	CHECK(selection.addExcludes("excluded", error));
+	ir.stamp([&](StackStamp_t& ss) { ss.setSelection(&selection); });
+	CHECK(ir.succeeded());
+
+	const auto &eh_pgms=firp->getAllEhPrograms();
+	const auto new_pgm=stamped_insns[0]->getEhProgram();
+	CHECK(eh_pgms.size()==2);
+	CHECK(eh_pgms.count(new_pgm)==1);
+	CHECK(eh_pgms.count(excluded_pgm)==1);
+	CHECK(eh_pgms.count(unused_pgm)==0);
+	return true;
+}
+
+//
+// Where the EH stamp rule goes (see StackStamp_t::finish_cie_stamp_rules):  build two functions that share 
+// an EH program, stamp them (excluding any named in exclude), and return the EH program each instruction
+// of the first function ends up with.
+//
+static const auto test_cie=EhProgramListing_t({"cie"});
+static const auto test_fde=EhProgramListing_t({"fde"});
+
+static bool stamp_shared_eh_program(const string& exclude, bool in_fde, EhProgram_t*& orig, set<EhProgram_t*>& stamped_pgms, TestIR_t& ir)
+{
+	auto f_insns=vector<Instruction_t*>();
+	auto g_insns=vector<Instruction_t*>();
+	const auto f=ir.addFunction("f", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret}, &f_insns);
+	ir.addFunction("g", {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret}, &g_insns);
+
+	orig=ir.getFileIR()->addEhProgram(nullptr, 1, -8, 16, 8, test_cie, test_fde);
+	for(const auto insn : f_insns)
+		insn->setEhProgram(orig);
+	for(const auto insn : g_insns)
+		insn->setEhProgram(orig);
+
+	auto selection=Selection_t();
+	auto error=string();
+	CHECK(exclude.empty() || selection.addExcludes(exclude, error));
+	ir.stamp([&](StackStamp_t& ss)
+		{
+			ss.setStampRuleInFDE(in_fde);
+			if(!exclude.empty())
+				ss.setSelection(&selection);
+		});
+	CHECK(ir.succeeded());
+	CHECK(is_stamped(f));
+
+	// f's instructions, including the stamps
+	for(const auto insn : f->getInstructions())
+		stamped_pgms.insert(insn->getEhProgram());
+	return true;
+}
+
+// When only stamped functions use a program, the rule goes in its CIE, and no new program is made.
+static bool test_cie_rule_updates_program_in_place()
+{
+	auto ir=TestIR_t();
+	auto orig=(EhProgram_t*)nullptr;
+	auto stamped_pgms=set<EhProgram_t*>();
+	CHECK(stamp_shared_eh_program("", false, orig, stamped_pgms, ir));
+
+	CHECK(stamped_pgms==set<EhProgram_t*>({orig}));
+	CHECK(ir.getFileIR()->getAllEhPrograms()==EhProgramSet_t({orig}));
+	CHECK(orig->getCIEProgram().size()==2 && orig->getCIEProgram()[0]==test_cie[0]);
+	CHECK(orig->getFDEProgram()==test_fde);
+	return true;
+}
+
+// When an unstamped function also uses it, the stamped function gets a copy with the rule in its CIE.
+static bool test_cie_rule_copies_program_shared_with_unstamped()
+{
+	auto ir=TestIR_t();
+	auto orig=(EhProgram_t*)nullptr;
+	auto stamped_pgms=set<EhProgram_t*>();
+	CHECK(stamp_shared_eh_program("g", false, orig, stamped_pgms, ir));
+
+	CHECK(stamped_pgms.size()==1);
+	const auto copy=*stamped_pgms.begin();
+	CHECK(copy!=orig);
+	CHECK(ir.getFileIR()->getAllEhPrograms()==EhProgramSet_t({orig, copy}));
+	CHECK(orig->getCIEProgram()==test_cie);
+	CHECK(copy->getCIEProgram().size()==2 && copy->getCIEProgram()[0]==test_cie[0]);
+	CHECK(copy->getFDEProgram()==test_fde);
+	return true;
+}
+
+// setStampRuleInFDE brings back the rule at the start of each FDE.
+static bool test_fde_rule_on_request()
+{
+	auto ir=TestIR_t();
+	auto orig=(EhProgram_t*)nullptr;
+	auto stamped_pgms=set<EhProgram_t*>();
+	CHECK(stamp_shared_eh_program("", true, orig, stamped_pgms, ir));
+
+	CHECK(stamped_pgms.size()==1);
+	const auto copy=*stamped_pgms.begin();
+	CHECK(copy!=orig);
+	CHECK(copy->getCIEProgram()==test_cie);
+	CHECK(copy->getFDEProgram().size()==2 && copy->getFDEProgram()[1]==test_fde[0]);
+	return true;
+}
+
+//
+// Function order (see StackStamp_t::sort_functions):  with a maximum of n functions, the first n functions 
+// in the order of the old set comparator (by name, then by pointer for functions with the same name) are 
+// the ones stamped.  The names tie, share long prefixes, and differ only by a trailing NUL.
+//
+static bool test_sort_order_matches_name_comparator()
+{
+	const auto names=vector<string>(
+		{
+			"same", "b", "same", "a_long_common_prefix_of_names_1", "a_long_common_prefix_of_names_", 
+			string("ab\0", 3), "same", "ab", "a_long_common_prefix_of_names_0", "same"
+		});
+
+	for(auto n=size_t(1); n<=names.size(); n++)
+	{
+		auto ir=TestIR_t();
+		auto funcs=vector<Function_t*>();
+		for(const auto &name : names)
+			funcs.push_back(ir.addFunction(name, {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret}));
+
+		auto expected=funcs;
+		sort(ALLOF(expected), [](const Function_t* lhs, const Function_t* rhs)
+			{
+				return tie(lhs->getName(), lhs) < tie(rhs->getName(), rhs);
+			});
+		expected.resize(n);
+
+		auto selection=Selection_t();
+		selection.setMaxFunctions(n);
+		ir.stamp([&](StackStamp_t& ss) { ss.setSelection(&selection); });
+		CHECK(ir.succeeded());
+
+		auto stamped=vector<Function_t*>();
+		copy_if(ALLOF(funcs), back_inserter(stamped), is_stamped);
+		CHECK(set<Function_t*>(ALLOF(stamped))==set<Function_t*>(ALLOF(expected)));
+	}
+	return true;
+}
+
+//
+// Selection (see Selection_t::endIndex):  phase 1 stops at the last function the selection can pick, 
+// whether that's bounded by an include list or by address ranges.
+//
+static bool examined_with_selection(const function<bool(Selection_t&, const vector<Function_t*>&)>& select, string& log)
+{
+	auto ir=TestIR_t();
+	auto funcs=vector<Function_t*>();
+	for(auto i=0; i<10; i++)
+		funcs.push_back(ir.addFunction("f"+to_string(i), {push_rbp, mov_rbp_rsp, mov_eax_ebx, pop_rbp, ret}));
+
+	auto selection=Selection_t();
+	CHECK(select(selection, funcs));
+	log=ir.stamp([&](StackStamp_t& ss) { ss.setSelection(&selection); });
+	CHECK(ir.succeeded());
+	return true;
+}
+
+static bool test_selection_stops_after_last_include()
+{
+	auto log=string();
+	CHECK(examined_with_selection([](Selection_t& selection, const vector<Function_t*>&)
+		{
+			auto error=string();
+			return selection.addIncludes("f1", error);
+		}, log));
+	CHECK(log.find("Functions_Transformed=1\n")!=string::npos);
+	CHECK(log.find("functions_examined=2\n")!=string::npos);
+	return true;
+}
+
+static bool test_selection_stops_after_last_address()
+{
+	auto log=string();
+	CHECK(examined_with_selection([](Selection_t& selection, const vector<Function_t*>& funcs)
+		{
+			auto error=string();
+			const auto entry=funcs[3]->getEntryPoint()->getAddress()->getVirtualOffset();
+			stringstream range; // stringstream has no copy constructor, cannot use auto style decls.
+			range << hex << entry;
+			return selection.addAddressRanges(range.str(), error);
+		}, log));
+	CHECK(log.find("Functions_Transformed=1\n")!=string::npos);
+	CHECK(log.find("functions_examined=4\n")!=string::npos);
+	return true;
+}
+
+int main()
+{
+	FileIR_t::setArchitecture(64);
+
+	const auto tests=vector<pair<string, function<bool()> > >(
+		{
+			{"stamps_entry_and_returns",          test_stamps_entry_and_returns},
+			{"never_returns_is_skipped",          test_never_returns_is_skipped},
+			{"returns_on_some_path_is_stamped",   test_returns_on_some_path_is_stamped},
+			{"safe_leaf_plain",                   test_safe_leaf_plain},
+			{"safe_leaf_push_rsp",                test_safe_leaf_push_rsp},
+			{"safe_leaf_lea_rsp",                 test_safe_leaf_lea_rsp},
+			{"safe_leaf_write_via_rbp",           test_safe_leaf_write_via_rbp},
+			{"safe_leaf_balanced_push_rbp",       test_safe_leaf_balanced_push_rbp},
+			{"safe_leaf_push_rbp_after_write",    test_safe_leaf_push_rbp_after_write},
+			{"consolidated_returns_are_plain_jumps", test_consolidated_returns_are_plain_jumps},
+			{"tail_jump_fused_with_stamped_target", test_tail_jump_fused_with_stamped_target},
+			{"tail_jump_to_unstamped_target_is_stamped", test_tail_jump_to_unstamped_target_is_stamped},
+			{"ib_verdicts_match_icfs_scan",       test_ib_verdicts_match_icfs_scan},
+			{"fixed_call_is_not_a_tail_jump",     test_fixed_call_is_not_a_tail_jump},
+			{"counter_precedes_stamp",            test_counter_precedes_stamp},
+			{"unused_eh_programs_are_dropped",    test_unused_eh_programs_are_dropped},
+			{"cie_rule_updates_program_in_place", test_cie_rule_updates_program_in_place},
+			{"cie_rule_copies_program_shared_with_unstamped", test_cie_rule_copies_program_shared_with_unstamped},
+			{"fde_rule_on_request",               test_fde_rule_on_request},
+			{"sort_order_matches_name_comparator", test_sort_order_matches_name_comparator},
+			{"selection_stops_after_last_include", test_selection_stops_after_last_include},
+			{"selection_stops_after_last_address", test_selection_stops_after_last_address},
+		});
+
+	auto failures=0;
+	for(const auto &t : tests)
+	{
+		const auto passed=t.second();
+		cout << (passed ? "PASS " : "FAIL ") << t.first << endl;
+		if(!passed)
+			failures++;
+	}
+	cout << dec << tests.size()-failures << " of " << tests.size() << " tests passed" << endl;
+	return failures==0 ? 0 : 1;
+}